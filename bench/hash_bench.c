@@ -0,0 +1,60 @@
+// Compares the string hash used by the interpreter against the byte at a
+// time FNV-1a it replaced, over the key lengths seen in practice:
+// identifiers, short literals and long strings read from input files.
+
+#include "common.h"
+#include "hash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static u32 fnv1a(const char *key, usize length) {
+    u32 hash = 2166136261U;  // NOLINT
+    for (usize i = 0; i < length; ++i) {
+        hash ^= (u8)key[i];
+        hash *= 16777619U;  // NOLINT
+    }
+    return hash;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+typedef u32 (*HashFn)(const char *key, usize length);
+
+// Returns throughput in MB/s
+static double measure(HashFn hash, const char *buffer, usize length, usize totalBytes, u32 *sink) {
+    usize const rounds = totalBytes / length;
+    double const start = now();
+    for (usize i = 0; i < rounds; ++i) {
+        *sink ^= hash(buffer + (i & 7U), length);
+    }
+    double const elapsed = now() - start;
+    return (double)(rounds * length) / elapsed / 1e6;
+}
+
+int main(void) {
+    usize const lengths[] = {4, 8, 16, 32, 64, 256, 4096, 1U << 20U};
+    usize const totalBytes = 1U << 28U;
+    usize const maxLength = 1U << 20U;
+
+    char *buffer = (char *)malloc(maxLength + 8U);
+    if (buffer == NULL) { return 1; }
+    srand(42);  // NOLINT
+    for (usize i = 0; i < maxLength + 8U; ++i) {
+        buffer[i] = (char)('a' + rand() % 26);  // NOLINT
+    }
+
+    u32 sink = 0;
+    printf("%10s %14s %14s %8s\n", "length", "fnv1a MB/s", "hash MB/s", "speedup");
+    for (usize i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i) {
+        double const before = measure(fnv1a, buffer, lengths[i], totalBytes, &sink);
+        double const after = measure(hashString, buffer, lengths[i], totalBytes, &sink);
+        printf("%10zu %14.0f %14.0f %7.1fx\n", lengths[i], before, after, after / before);
+    }
+    free(buffer);
+    return sink == 0x12345678U ? 2 : 0;  // Keeps the hashing from being optimized away
+}
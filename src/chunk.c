@@ -1,8 +1,13 @@
 #include "chunk.h"
 
 #include "memory.h"
+#include "object.h"
 #include "vm.h"
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+
+#define CONSTANT_MAX_LOAD 0.75F
 
 void initChunk(Chunk *chunk) {
     chunk->count = 0;
@@ -10,12 +15,18 @@ void initChunk(Chunk *chunk) {
     chunk->code = NULL;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
+    chunk->constantSlots = NULL;
+    chunk->constantSlotCapacity = 0;
+    chunk->inlined = NULL;
+    chunk->inlinedCount = 0;
 }
 
 void freeChunk(Chunk *chunk) {
     FREE_ARRAY(u8, chunk->code, chunk->capacity);
     FREE_ARRAY(usize, chunk->lines, chunk->capacity);
     freeValueArray(&chunk->constants);
+    FREE_ARRAY(usize, chunk->constantSlots, chunk->constantSlotCapacity);
+    FREE_ARRAY(InlinedCode, chunk->inlined, chunk->inlinedCount);
     initChunk(chunk);
 }
 
@@ -31,9 +42,189 @@ void writeChunk(Chunk *chunk, u8 byte, usize line) {
     chunk->count++;
 }
 
+// Constants are only shared when they behave the same: 1 and 1.0, or 0.0
+// and -0.0, stay apart
+#ifdef NAN_BOXING
+static u64 constantBits(Value value) {
+    return value;
+}
+
+static bool isSameConstant(Value a, Value b) {
+    return a == b;
+}
+#else
+static u64 constantBits(Value value) {
+    switch (value.type) {
+    case VAL_BOOL: return value.as.boolean ? 1U : 0U;
+    case VAL_NIL: return 0;
+    case VAL_NUMBER: {
+        u64 bits;  // NOLINT
+        memcpy(&bits, &value.as.number, sizeof(bits));
+        return bits;
+    }
+    case VAL_INT: return (u64)value.as.integer;
+    case VAL_OBJ: return (u64)(uintptr_t)value.as.obj;
+    default: __builtin_unreachable();
+    }
+}
+
+static bool isSameConstant(Value a, Value b) {
+    return a.type == b.type && constantBits(a) == constantBits(b);
+}
+#endif
+
+static usize hashConstant(Value value) {
+    u64 bits = constantBits(value);
+    bits ^= bits >> 33U;
+    bits *= 0xFF51AFD7ED558CCDU;
+    bits ^= bits >> 33U;
+    return (usize)bits;
+}
+
+static usize *findSlot(usize *slots, usize capacity, ValueArray const *constants, Value value) {
+    usize index = hashConstant(value) & (capacity - 1U);
+    while (true) {
+        usize *slot = &slots[index];
+        if (*slot == 0 || isSameConstant(constants->values[*slot - 1U], value)) { return slot; }
+        index = (index + 1U) & (capacity - 1U);
+    }
+}
+
+static void adjustSlots(Chunk *chunk, usize capacity) {
+    usize *slots = ALLOCATE(usize, capacity);
+    memset(slots, 0, sizeof(usize) * capacity);
+    for (usize i = 0; i < chunk->constants.count; ++i) {
+        *findSlot(slots, capacity, &chunk->constants, chunk->constants.values[i]) = i + 1U;
+    }
+    FREE_ARRAY(usize, chunk->constantSlots, chunk->constantSlotCapacity);
+    chunk->constantSlots = slots;
+    chunk->constantSlotCapacity = capacity;
+}
+
+bool findConstant(Chunk const *chunk, Value value, usize *index) {
+    if (chunk->constantSlotCapacity == 0) { return false; }
+    usize const slot = *findSlot(chunk->constantSlots, chunk->constantSlotCapacity, &chunk->constants, value);
+    if (slot == 0) { return false; }
+    *index = slot - 1U;
+    return true;
+}
+
+// Returns the index of an equal constant instead if there is one
 usize addConstant(Chunk *chunk, Value value) {
+    usize index;  // NOLINT
+    if (findConstant(chunk, value, &index)) { return index; }
     push(value);
     writeValueArray(&chunk->constants, value);
+    index = chunk->constants.count - 1U;
+    if ((float)chunk->constants.count > (float)chunk->constantSlotCapacity * CONSTANT_MAX_LOAD) {
+        adjustSlots(chunk, GROW_CAPACITY(chunk->constantSlotCapacity));
+    } else {
+        *findSlot(chunk->constantSlots, chunk->constantSlotCapacity, &chunk->constants, value) = index + 1U;
+    }
     pop();
-    return chunk->constants.count - 1U;
+    return index;
+}
+
+void removeLastConstant(Chunk *chunk) {
+    ValueArray *constants = &chunk->constants;
+    usize *slots = chunk->constantSlots;
+    usize const mask = chunk->constantSlotCapacity - 1U;
+    usize hole = (usize)(findSlot(slots, chunk->constantSlotCapacity, constants, constants->values[constants->count - 1U]) - slots);
+    for (usize next = (hole + 1U) & mask; slots[next] != 0; next = (next + 1U) & mask) {
+        usize const home = hashConstant(constants->values[slots[next] - 1U]) & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            slots[hole] = slots[next];
+            hole = next;
+        }
+    }
+    slots[hole] = 0;
+    --constants->count;
+}
+
+static usize wideOperandLength(Chunk const *chunk, usize offset) {
+    switch (chunk->code[offset]) {
+    case OP_CONSTANT:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_FLAT_UPVALUE:
+    case OP_CLASS:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_METHOD:
+    case OP_GET_SUPER:
+        return 2;
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+        return 3;
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP:
+    case OP_LOOP:
+        return 4;
+    case OP_FOR_ITER:
+        return 6;
+    case OP_CLOSURE: {
+        usize const constant = (usize)(chunk->code[offset + 1U] << 8U) | chunk->code[offset + 2U];
+        ObjFunction const *function = AS_FUNCTION(chunk->constants.values[constant]);
+        return 2U + 3U * function->upvalueCount;
+    }
+    default:
+        return 0;
+    }
+}
+
+// Bytes after the opcode at `offset`. Those of OP_WIDE include the opcode
+// it widens.
+usize operandLength(Chunk const *chunk, usize offset) {
+    switch (chunk->code[offset]) {
+    case OP_WIDE:
+        return 1U + wideOperandLength(chunk, offset + 1U);
+    case OP_CONSTANT:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_FLAT_UPVALUE:
+    case OP_CALL:
+    case OP_CLASS:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_LIST:
+    case OP_MAP:
+    case OP_METHOD:
+    case OP_GET_SUPER:
+    case OP_INLINE_RETURN:
+        return 1;
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+        return 2;
+    case OP_FOR_ITER:
+        return 3;
+    case OP_GUARD_CALLEE:
+        return 4;
+    case OP_CLOSURE: {
+        ObjFunction const *function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1U]]);
+        return 1U + 2U * function->upvalueCount;
+    }
+    default:
+        return 0;
+    }
+}
+
+InlinedCode const *findInlinedCode(Chunk const *chunk, usize offset) {
+    for (usize i = 0; i < chunk->inlinedCount; ++i) {
+        InlinedCode const *inlined = &chunk->inlined[i];
+        if (offset >= inlined->start && offset < inlined->end) { return inlined; }
+    }
+    return NULL;
 }
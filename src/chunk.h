@@ -28,8 +28,10 @@ typedef enum {
     OP_SET_LOCAL,
     OP_GET_UPVALUE,
     OP_SET_UPVALUE,
+    OP_GET_FLAT_UPVALUE,
     OP_JUMP_IF_FALSE,
     OP_LOOP,
+    OP_FOR_ITER,
     OP_CALL,
     OP_JUMP,
     OP_CLOSURE,
@@ -37,24 +39,57 @@ typedef enum {
     OP_CLASS,
     OP_GET_PROPERTY,
     OP_SET_PROPERTY,
+    OP_LIST,
+    OP_MAP,
+    OP_GET_INDEX,
+    OP_SET_INDEX,
     OP_METHOD,
+    OP_END_CLASS,
     OP_INVOKE,
     OP_INHERIT,
     OP_GET_SUPER,
     OP_SUPER_INVOKE,
+    OP_GUARD_CALLEE,
+    OP_INLINE_RETURN,
+    OP_WIDE,
 } OpCode;
 
+// OP_WIDE prefixes an instruction whose constant, slot and upvalue indexes
+// take two bytes and whose jump offset takes four. Counts and flags keep
+// one byte.
+
+// Flags of the (flags, index) pairs that follow OP_CLOSURE
+#define UPVALUE_LOCAL 0x01U
+#define UPVALUE_BY_VALUE 0x02U
+
+// Code the optimizer copied in from a function it inlined. Stack traces
+// show it as a call to that function made from `line`.
+typedef struct {
+    usize start;
+    usize end;
+    usize line;
+    ObjString *name;
+} InlinedCode;
+
 typedef struct {
     usize count;
     usize capacity;
     u8 *code;
     usize *lines;
     ValueArray constants;
+    usize *constantSlots;  // Hash index of constants: index plus one, 0 if empty
+    usize constantSlotCapacity;
+    InlinedCode *inlined;
+    usize inlinedCount;
 } Chunk;
 
 void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, u8 byte, usize line);
 usize addConstant(Chunk *chunk, Value value);
+bool findConstant(Chunk const *chunk, Value value, usize *index);
+void removeLastConstant(Chunk *chunk);
+usize operandLength(Chunk const *chunk, usize offset);
+InlinedCode const *findInlinedCode(Chunk const *chunk, usize offset);
 
 #endif
@@ -37,4 +37,7 @@ typedef size_t usize;
 // NOLINTNEXTLINE
 #define UINT8_COUNT (UINT8_MAX + 1U)
 
+// NOLINTNEXTLINE
+#define UINT16_COUNT (UINT16_MAX + 1U)
+
 #endif
@@ -10,6 +10,7 @@
 #include "debug.h"
 #endif
 #include "object.h"
+#include "optimizer.h"
 #include "scanner.h"
 #include "value.h"
 #include <stdio.h>
@@ -18,6 +19,8 @@
 typedef struct {
     Token current;
     Token previous;
+    usize leftStart;  // Code offset of the left operand of an infix rule
+    i32 braceDepth;
     bool hadError;
     bool panicMode;
 } Parser;
@@ -44,17 +47,32 @@ typedef struct {
     Precedence precedence;
 } ParseRule;
 
+typedef enum {
+    CAPTURE_NONE,
+    CAPTURE_BY_VALUE,
+    CAPTURE_BY_REFERENCE,
+} CaptureMode;
+
 typedef struct {
     Token name;
     i32 depth;
-    bool isCaptured;
+    i32 braceDepth;
+    CaptureMode capture;
+    bool isAssigned;
 } Local;
 
 typedef struct {
-    u8 index;
+    u16 index;
     bool isLocal;
+    bool byValue;
 } Upvalue;
 
+// A forward jump too far for a two-byte offset, widened by endCompiler
+typedef struct {
+    usize offset;  // Of the jump's operand
+    usize target;
+} FarJump;
+
 typedef enum {
     TYPE_FUNCTION,
     TYPE_INITIALIZER,
@@ -66,10 +84,18 @@ typedef struct Compiler {
     struct Compiler *enclosing;
     ObjFunction *function;
     FunctionType type;
-    Local locals[UINT8_COUNT];
+    Local *locals;
     usize localCount;
-    Upvalue upvalues[UINT8_COUNT];
+    usize localCapacity;
+    Upvalue *upvalues;
+    usize upvalueCapacity;
+    FarJump *farJumps;
+    usize farJumpCount;
+    usize farJumpCapacity;
     i32 scopeDepth;
+    usize constantUses[UINT8_COUNT];  // Operands that refer to each constant
+    usize lastNot;  // Offset of the last OP_NOT, or SIZE_MAX
+    usize doubleNotEnd;  // Where the last `!!` ends, or SIZE_MAX
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -80,13 +106,14 @@ typedef struct ClassCompiler {
 Parser parser;  // NOLINT
 Compiler *current = NULL;  // NOLINT
 ClassCompiler *currentClass = NULL;  // NOLINT
+bool optimizing = false;  // NOLINT
 
 static void expression(void);
 static void statement(void);
 static void declaration(void);
 static ParseRule const *getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
-static u8 identifierConstant(Token *name);
+static usize identifierConstant(Token *name);
 static i32 resolveLocal(Compiler *compiler, Token *name);
 static void and_(bool canAssign);
 static u8 argumentList(void);
@@ -124,6 +151,11 @@ static void errorAtCurrent(const char *message) {
 
 static void advance(void) {
     parser.previous = parser.current;
+    if (parser.previous.type == TOKEN_LEFT_BRACE) {
+        ++parser.braceDepth;
+    } else if (parser.previous.type == TOKEN_RIGHT_BRACE) {
+        --parser.braceDepth;
+    }
 
     while (true) {
         parser.current = scanToken();
@@ -161,10 +193,19 @@ static void emitBytes(u8 byte1, u8 byte2) {
 }
 
 static void emitLoop(usize loopStart) {
-    emitByte(OP_LOOP);
-    usize const offset = 2U + currentChunk()->count - loopStart;
-    if (offset > UINT16_MAX) { error("Loop body too large"); }
+    usize offset = 3U + currentChunk()->count - loopStart;
+    if (offset <= UINT16_MAX) {
+        emitByte(OP_LOOP);
+        emitByte((offset >> 8U) & 0xFFU);  // NOLINT
+        emitByte(offset & 0xFFU);  // NOLINT
+        return;
+    }
 
+    offset += 3U;
+    if (offset > UINT32_MAX) { error("Loop body too large"); }
+    emitBytes(OP_WIDE, OP_LOOP);
+    emitByte((offset >> 24U) & 0xFFU);  // NOLINT
+    emitByte((offset >> 16U) & 0xFFU);  // NOLINT
     emitByte((offset >> 8U) & 0xFFU);  // NOLINT
     emitByte(offset & 0xFFU);  // NOLINT
 }
@@ -185,35 +226,98 @@ static void emitReturn(void) {
     emitByte(OP_RETURN);
 }
 
-static u8 makeConstant(Value value) {
+// Emits the instruction with a one-byte operand, or behind OP_WIDE with a
+// two-byte one when the operand needs it
+static void emitIndexed(OpCode instruction, usize operand) {
+    if (operand <= UINT8_MAX) {
+        emitBytes((u8)instruction, (u8)operand);
+        return;
+    }
+    emitBytes(OP_WIDE, (u8)instruction);
+    emitBytes((u8)(operand >> 8U), (u8)operand);
+}
+
+static usize makeConstant(Value value) {
+    usize const count = currentChunk()->constants.count;
     usize const constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX) {
+    if (constant > UINT16_MAX) {
         error("Too many contants in one chunk.");
         return 0;
     }
 
-    return (u8)constant;
+    // Only one-byte constants can be folded away
+    if (constant <= UINT8_MAX) {
+        if (constant == count) { current->constantUses[constant] = 0; }
+        ++current->constantUses[constant];
+    }
+    return constant;
 }
 
 static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    emitIndexed(OP_CONSTANT, makeConstant(value));
 }
 
 static void patchJump(usize offset) {
+    // A jump lands here, so condition() must keep a `!!` that ends here
+    current->doubleNotEnd = SIZE_MAX;
     usize const jump = currentChunk()->count - offset - 2U;
     if (jump > UINT16_MAX) {
-        error("Too many code jump over.");
+        if (current->farJumpCapacity < current->farJumpCount + 1U) {
+            usize const oldCapacity = current->farJumpCapacity;
+            current->farJumpCapacity = GROW_CAPACITY(oldCapacity);
+            current->farJumps = GROW_ARRAY(FarJump, current->farJumps, oldCapacity, current->farJumpCapacity);
+        }
+        current->farJumps[current->farJumpCount].offset = offset;
+        current->farJumps[current->farJumpCount].target = currentChunk()->count;
+        ++current->farJumpCount;
+        return;
     }
     currentChunk()->code[offset] = (jump >> 8) & 0xFF;  // NOLINT
     currentChunk()->code[offset + 1] = jump & 0xFF;  // NOLINT
 }
 
+static void patchWideJump(usize offset) {
+    // A jump lands here, so condition() must keep a `!!` that ends here
+    current->doubleNotEnd = SIZE_MAX;
+    usize const jump = currentChunk()->count - offset - 4U;
+    if (jump > UINT32_MAX) {
+        error("Too many code jump over.");
+    }
+    currentChunk()->code[offset] = (jump >> 24U) & 0xFFU;  // NOLINT
+    currentChunk()->code[offset + 1U] = (jump >> 16U) & 0xFFU;  // NOLINT
+    currentChunk()->code[offset + 2U] = (jump >> 8U) & 0xFFU;  // NOLINT
+    currentChunk()->code[offset + 3U] = jump & 0xFFU;  // NOLINT
+}
+
+// Makes room for one more local and returns it
+static Local *pushLocal(Compiler *compiler) {
+    if (compiler->localCapacity < compiler->localCount + 1U) {
+        usize const oldCapacity = compiler->localCapacity;
+        compiler->localCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->locals = GROW_ARRAY(Local, compiler->locals, oldCapacity, compiler->localCapacity);
+    }
+    Local *local = &compiler->locals[compiler->localCount++];
+    if (compiler->localCount > compiler->function->slotCount) {
+        compiler->function->slotCount = compiler->localCount;
+    }
+    return local;
+}
+
 static void initCompiler(Compiler *compiler, FunctionType type) {
     compiler->enclosing = current;
     compiler->function = NULL;
     compiler->type = type;
+    compiler->locals = NULL;
     compiler->localCount = 0;
+    compiler->localCapacity = 0;
+    compiler->upvalues = NULL;
+    compiler->upvalueCapacity = 0;
+    compiler->farJumps = NULL;
+    compiler->farJumpCount = 0;
+    compiler->farJumpCapacity = 0;
     compiler->scopeDepth = 0;
+    compiler->lastNot = SIZE_MAX;
+    compiler->doubleNotEnd = SIZE_MAX;
     compiler->function = newFunction();
     current = compiler;
 
@@ -221,9 +325,11 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
         current->function->name = copyString(parser.previous.start, parser.previous.length);
     }
 
-    Local *local = &current->locals[current->localCount++];
+    Local *local = pushLocal(current);
     local->depth = 0;
-    local->isCaptured = false;
+    local->braceDepth = parser.braceDepth;
+    local->capture = CAPTURE_NONE;
+    local->isAssigned = false;
     if (type != TYPE_FUNCTION) {
         local->name.start = "this";
         local->name.length = 4;
@@ -233,9 +339,136 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
     }
 }
 
+static bool isJumpInstruction(u8 instruction) {
+    return instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE || instruction == OP_LOOP
+           || instruction == OP_FOR_ITER;
+}
+
+// Index of the last instruction that starts at or before `offset`
+static usize findInstruction(usize const *starts, usize count, usize offset) {
+    usize low = 0;
+    usize high = count;
+    while (high - low > 1U) {
+        usize const middle = low + (high - low) / 2U;
+        if (starts[middle] <= offset) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Rewrites the function's code so that the far jumps, and any jump pushed
+// out of range by the bytes that adds, use OP_WIDE
+static void widenJumps(void) {
+    Chunk *chunk = currentChunk();
+    usize count = 0;
+    for (usize offset = 0; offset < chunk->count; offset += 1U + operandLength(chunk, offset)) { ++count; }
+    usize *starts = ALLOCATE(usize, count + 1U);
+    usize *targets = ALLOCATE(usize, count);  // Instruction jumped to, or SIZE_MAX
+    bool *isWide = ALLOCATE(bool, count);
+    usize *moved = ALLOCATE(usize, count + 1U);
+
+    usize start = 0;
+    for (usize i = 0; i < count; ++i) {
+        starts[i] = start;
+        bool const hasPrefix = chunk->code[start] == OP_WIDE;
+        u8 const instruction = chunk->code[start + (hasPrefix ? 1U : 0U)];
+        usize const end = start + 1U + operandLength(chunk, start);
+        isWide[i] = hasPrefix;
+        targets[i] = SIZE_MAX;
+        if (isJumpInstruction(instruction)) {
+            u8 const *operand = &chunk->code[end - (hasPrefix ? 4U : 2U)];
+            usize distance = (usize)operand[0] << 8U | operand[1];
+            if (hasPrefix) { distance = distance << 16U | (usize)operand[2] << 8U | operand[3]; }
+            targets[i] = instruction == OP_LOOP ? end - distance : end + distance;
+        }
+        start = end;
+    }
+    starts[count] = chunk->count;
+    for (usize i = 0; i < current->farJumpCount; ++i) {
+        usize const jump = findInstruction(starts, count, current->farJumps[i].offset);
+        targets[jump] = current->farJumps[i].target;
+        isWide[jump] = true;
+    }
+    for (usize i = 0; i < count; ++i) {
+        if (targets[i] != SIZE_MAX) { targets[i] = findInstruction(starts, count + 1U, targets[i]); }
+    }
+
+    // Widening only ever moves code further apart, so this settles
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        moved[0] = 0;
+        for (usize i = 0; i < count; ++i) {
+            usize length = starts[i + 1U] - starts[i];
+            if (isWide[i] && chunk->code[starts[i]] != OP_WIDE) {
+                length += chunk->code[starts[i]] == OP_FOR_ITER ? 4U : 3U;
+            }
+            moved[i + 1U] = moved[i] + length;
+        }
+        for (usize i = 0; i < count; ++i) {
+            if (targets[i] == SIZE_MAX || isWide[i]) { continue; }
+            usize const end = moved[i + 1U];
+            usize const target = moved[targets[i]];
+            if ((target > end ? target - end : end - target) > UINT16_MAX) {
+                isWide[i] = true;
+                changed = true;
+            }
+        }
+    }
+
+    u8 *code = ALLOCATE(u8, moved[count]);
+    usize *lines = ALLOCATE(usize, moved[count]);
+    for (usize i = 0; i < count; ++i) {
+        usize const from = starts[i];
+        usize to = moved[i];
+        if (targets[i] == SIZE_MAX) {
+            memcpy(&code[to], &chunk->code[from], starts[i + 1U] - from);
+            memcpy(&lines[to], &chunk->lines[from], sizeof(usize) * (starts[i + 1U] - from));
+            continue;
+        }
+        bool const hasPrefix = chunk->code[from] == OP_WIDE;
+        u8 const instruction = chunk->code[from + (hasPrefix ? 1U : 0U)];
+        if (isWide[i]) { code[to++] = OP_WIDE; }
+        code[to++] = instruction;
+        if (instruction == OP_FOR_ITER) {
+            usize slot = chunk->code[from + (hasPrefix ? 2U : 1U)];
+            if (hasPrefix) { slot = slot << 8U | chunk->code[from + 3U]; }
+            if (isWide[i]) { code[to++] = (u8)(slot >> 8U); }
+            code[to++] = (u8)slot;
+        }
+        usize const end = moved[i + 1U];
+        usize const target = moved[targets[i]];
+        usize const distance = instruction == OP_LOOP ? end - target : target - end;
+        if (isWide[i]) {
+            code[to++] = (u8)(distance >> 24U);
+            code[to++] = (u8)(distance >> 16U);
+        }
+        code[to++] = (u8)(distance >> 8U);
+        code[to] = (u8)distance;
+        for (usize j = moved[i]; j < end; ++j) { lines[j] = chunk->lines[from]; }
+    }
+
+    FREE_ARRAY(u8, chunk->code, chunk->capacity);
+    FREE_ARRAY(usize, chunk->lines, chunk->capacity);
+    chunk->code = code;
+    chunk->lines = lines;
+    chunk->count = moved[count];
+    chunk->capacity = moved[count];
+    FREE_ARRAY(usize, moved, count + 1U);
+    FREE_ARRAY(bool, isWide, count);
+    FREE_ARRAY(usize, targets, count);
+    FREE_ARRAY(usize, starts, count + 1U);
+}
+
 static ObjFunction *endCompiler(void) {
     emitReturn();
     ObjFunction *function = current->function;
+    if (current->farJumpCount > 0 && !parser.hadError) { widenJumps(); }
+    FREE_ARRAY(FarJump, current->farJumps, current->farJumpCapacity);
+    FREE_ARRAY(Local, current->locals, current->localCapacity);
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
         disassembleChunk(currentChunk(),
@@ -257,7 +490,7 @@ static void endScope(void) {
 
     while (current->localCount > 0
            && current->locals[current->localCount - 1].depth > current->scopeDepth) {
-        if (current->locals[current->localCount - 1U].isCaptured) {
+        if (current->locals[current->localCount - 1U].capture == CAPTURE_BY_REFERENCE) {
             emitByte(OP_CLOSE_UPVALUE);
         } else {
             emitByte(OP_POP);
@@ -266,15 +499,159 @@ static void endScope(void) {
     }
 }
 
+static void emitNot(void) {
+    current->lastNot = currentChunk()->count;
+    emitByte(OP_NOT);
+}
+
+static void emitLiteral(Value value) {
+    if (IS_NIL(value)) {
+        emitByte(OP_NIL);
+    } else if (IS_BOOL(value)) {
+        emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else {
+        emitConstant(value);
+    }
+}
+
+// The value pushed by the code in [start, end) if that is a single literal
+static bool literalBetween(usize start, usize end, Value *value) {
+    Chunk const *chunk = currentChunk();
+    if (start >= end) { return false; }
+    switch (chunk->code[start]) {
+    case OP_CONSTANT:
+        *value = chunk->constants.values[chunk->code[start + 1U]];
+        return end - start == 2U;
+    case OP_NIL:
+        *value = NIL_VAL;
+        return end - start == 1U;
+    case OP_TRUE:
+        *value = BOOL_VAL(true);
+        return end - start == 1U;
+    case OP_FALSE:
+        *value = BOOL_VAL(false);
+        return end - start == 1U;
+    default:
+        return false;
+    }
+}
+
+// Drops the code from `start` on, which must be a single literal, and its
+// constant when nothing else uses it
+static void discardLiteral(usize start) {
+    Chunk *chunk = currentChunk();
+    if (chunk->code[start] == OP_CONSTANT) {
+        u8 const constant = chunk->code[start + 1U];
+        if (--current->constantUses[constant] == 0 && constant == chunk->constants.count - 1U) {
+            removeLastConstant(chunk);
+        }
+    }
+    chunk->count = start;
+    if (current->lastNot != SIZE_MAX && current->lastNot >= start) { current->lastNot = SIZE_MAX; }
+    if (current->doubleNotEnd != SIZE_MAX && current->doubleNotEnd > start) { current->doubleNotEnd = SIZE_MAX; }
+}
+
+static bool isFalseyLiteral(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static ObjString *joinStrings(ObjString const *a, ObjString const *b) {
+    ObjString *joined = allocateString(a->length + b->length);
+    memcpy(joined->chars, a->chars, a->length);
+    memcpy(joined->chars + a->length, b->chars, b->length);
+    return internString(joined);
+}
+
+// Evaluates `a op b` with the semantics of the VM. Operands that would be a
+// run-time error are left alone.
+static bool foldBinary(TokenType operatorType, Value a, Value b, Value *result) {
+    switch (operatorType) {
+    case TOKEN_EQUAL_EQUAL:
+        *result = BOOL_VAL(valuesEqual(a, b));
+        return true;
+    case TOKEN_BANG_EQUAL:
+        *result = BOOL_VAL(!valuesEqual(a, b));
+        return true;
+    case TOKEN_PLUS:
+        if (IS_STRING(a) && IS_STRING(b)) {
+            *result = OBJ_VAL(joinStrings(AS_STRING(a), AS_STRING(b)));
+            return true;
+        }
+        break;
+    default:
+        break;
+    }
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) { return false; }
+
+    if (IS_INT(a) && IS_INT(b)) {
+        i64 const x = AS_INT(a);
+        i64 const y = AS_INT(b);
+        i64 integer;  // NOLINT
+        bool exact = false;
+        switch (operatorType) {
+        case TOKEN_PLUS: exact = !__builtin_add_overflow(x, y, &integer); break;
+        case TOKEN_MINUS: exact = !__builtin_sub_overflow(x, y, &integer); break;
+        // A zero result with a negative operand is -0, which only doubles hold
+        case TOKEN_STAR:
+            exact = !__builtin_mul_overflow(x, y, &integer) && (integer != 0 || (x >= 0 && y >= 0));
+            break;
+        case TOKEN_SLASH:
+            exact = y != 0 && (x != 0 || y > 0) && x % y == 0;
+            if (exact) { integer = x / y; }
+            break;
+        case TOKEN_GREATER: *result = BOOL_VAL(x > y); return true;
+        case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(x >= y); return true;
+        case TOKEN_LESS: *result = BOOL_VAL(x < y); return true;
+        case TOKEN_LESS_EQUAL: *result = BOOL_VAL(x <= y); return true;
+        default: __builtin_unreachable();
+        }
+        if (exact && fitsSmallInt(integer)) {
+            *result = INT_VAL(integer);
+            return true;
+        }
+    }
+
+    double const x = AS_NUMBER(a);
+    double const y = AS_NUMBER(b);
+    switch (operatorType) {
+    case TOKEN_PLUS: *result = NUMBER_VAL(x + y); break;
+    case TOKEN_MINUS: *result = NUMBER_VAL(x - y); break;
+    case TOKEN_STAR: *result = NUMBER_VAL(x * y); break;
+    case TOKEN_SLASH: *result = NUMBER_VAL(x / y); break;
+    case TOKEN_GREATER: *result = BOOL_VAL(x > y); break;
+    // >= and <= run as the negated opposite comparison, which differs for NaN
+    case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(!(x < y)); break;
+    case TOKEN_LESS: *result = BOOL_VAL(x < y); break;
+    case TOKEN_LESS_EQUAL: *result = BOOL_VAL(!(x > y)); break;
+    default: __builtin_unreachable();
+    }
+    return true;
+}
+
 static void binary(bool canAssign) {
     (void)canAssign;
+    usize const leftStart = parser.leftStart;
     TokenType const operatorType = parser.previous.type;
     ParseRule const *rule = getRule(operatorType);
+    usize const rightStart = currentChunk()->count;
     parsePrecedence((Precedence)(rule->precedence + 1));
 
+    Value left;  // NOLINT
+    Value right;  // NOLINT
+    Value result;  // NOLINT
+    if (literalBetween(leftStart, rightStart, &left)
+        && literalBetween(rightStart, currentChunk()->count, &right)
+        && foldBinary(operatorType, left, right, &result)) {
+        discardLiteral(rightStart);
+        discardLiteral(leftStart);
+        emitLiteral(result);
+        return;
+    }
+
     switch (operatorType) {
     case TOKEN_BANG_EQUAL:
-        emitBytes(OP_EQUAL, OP_NOT);
+        emitByte(OP_EQUAL);
+        emitNot();
         break;
     case TOKEN_EQUAL_EQUAL:
         emitByte(OP_EQUAL);
@@ -283,13 +660,15 @@ static void binary(bool canAssign) {
         emitByte(OP_GREATER);
         break;
     case TOKEN_GREATER_EQUAL:
-        emitBytes(OP_LESS, OP_NOT);
+        emitByte(OP_LESS);
+        emitNot();
         break;
     case TOKEN_LESS:
         emitByte(OP_LESS);
         break;
     case TOKEN_LESS_EQUAL:
-        emitBytes(OP_GREATER, OP_NOT);
+        emitByte(OP_GREATER);
+        emitNot();
         break;
     case TOKEN_PLUS:
         emitByte(OP_ADD);
@@ -316,20 +695,67 @@ static void call(bool canAssign) {
 
 static void dot(bool canAssign) {
     consume(TOKEN_IDENTIFIER, "Expect property after '.'.");
-    u8 const name = identifierConstant(&parser.previous);
+    usize const name = identifierConstant(&parser.previous);
 
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(OP_SET_PROPERTY, name);
+        emitIndexed(OP_SET_PROPERTY, name);
     } else if (match(TOKEN_LEFT_PAREN)) {
         u8 const argCount = argumentList();
-        emitBytes(OP_INVOKE, name);
+        emitIndexed(OP_INVOKE, name);
         emitByte(argCount);
     } else {
-        emitBytes(OP_GET_PROPERTY, name);
+        emitIndexed(OP_GET_PROPERTY, name);
     }
 }
 
+static void subscript(bool canAssign) {
+    expression();
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+    if (canAssign && match(TOKEN_EQUAL)) {
+        expression();
+        emitByte(OP_SET_INDEX);
+    } else {
+        emitByte(OP_GET_INDEX);
+    }
+}
+
+static void list(bool canAssign) {
+    (void)canAssign;
+    u8 count = 0;
+    if (!check(TOKEN_RIGHT_BRACKET)) {
+        do {
+            expression();
+            if (count == UINT8_MAX) {
+                error("Can't have more than 255 elements in a list literal.");
+            } else {
+                ++count;
+            }
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+    emitBytes(OP_LIST, count);
+}
+
+static void map(bool canAssign) {
+    (void)canAssign;
+    u8 count = 0;
+    if (!check(TOKEN_RIGHT_BRACE)) {
+        do {
+            expression();
+            consume(TOKEN_COLON, "Expect ':' after map key.");
+            expression();
+            if (count == UINT8_MAX) {
+                error("Can't have more than 255 entries in a map literal.");
+            } else {
+                ++count;
+            }
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+    emitBytes(OP_MAP, count);
+}
+
 static void literal(bool canAssign) {
     (void)canAssign;
     switch (parser.previous.type) {
@@ -357,7 +783,12 @@ static void grouping(bool canAssign) {
 static void number(bool canAssign) {
     (void)canAssign;
     double const value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+    // Literals without a fractional part are integers when they fit
+    if (memchr(parser.previous.start, '.', parser.previous.length) == NULL && value <= (double)SMALL_INT_MAX) {
+        emitConstant(INT_VAL((i64)value));
+    } else {
+        emitConstant(NUMBER_VAL(value));
+    }
 }
 
 static void or_(bool canAssign) {
@@ -376,23 +807,24 @@ static void string(bool canAssign) {
 }
 
 static void namedVariable(Token name, bool canAssign) {
-    u8 getOp = OP_GET_GLOBAL;
-    u8 setOp = OP_SET_GLOBAL;
+    OpCode getOp = OP_GET_GLOBAL;
+    OpCode setOp = OP_SET_GLOBAL;
     i32 arg = resolveLocal(current, &name);
     if (arg != -1) {
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
     } else if ((arg = resolveUpvalue(current, &name)) != -1) {  // NOLINT  (yeah it sucks)
-        getOp = OP_GET_UPVALUE;
+        getOp = current->upvalues[arg].byValue ? OP_GET_FLAT_UPVALUE : OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     } else {
-        arg = identifierConstant(&name);
+        arg = (i32)identifierConstant(&name);
     }
     if (canAssign && match(TOKEN_EQUAL)) {
+        if (getOp == OP_GET_LOCAL) { current->locals[arg].isAssigned = true; }
         expression();
-        emitBytes(setOp, (u8)arg);
+        emitIndexed(setOp, (usize)arg);
     } else {
-        emitBytes(getOp, (u8)arg);
+        emitIndexed(getOp, (usize)arg);
     }
 }
 
@@ -416,16 +848,16 @@ static void super_(bool canAssing) {
     }
     consume(TOKEN_DOT, "Expect '.' after 'super'.");
     consume(TOKEN_IDENTIFIER, "Expect supeclass method name.");
-    u8 const name = identifierConstant(&parser.previous);
+    usize const name = identifierConstant(&parser.previous);
     namedVariable(syntheticToken("this"), false);
     if (match(TOKEN_LEFT_PAREN)) {
         u8 const argCount = argumentList();
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_SUPER_INVOKE, name);
+        emitIndexed(OP_SUPER_INVOKE, name);
         emitByte(argCount);
     } else {
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_GET_SUPER, name);
+        emitIndexed(OP_GET_SUPER, name);
     }
 }
 
@@ -441,12 +873,36 @@ static void this_(bool canAssing) {
 static void unary(bool canAssign) {
     (void)canAssign;
     TokenType const operatorType = parser.previous.type;
+    usize const operandStart = currentChunk()->count;
 
     parsePrecedence(PREC_UNARY);
 
+    Value operand;  // NOLINT
+    if (literalBetween(operandStart, currentChunk()->count, &operand)) {
+        if (operatorType == TOKEN_BANG) {
+            discardLiteral(operandStart);
+            emitLiteral(BOOL_VAL(isFalseyLiteral(operand)));
+            return;
+        }
+        if (IS_INT(operand) && AS_INT(operand) != 0 && fitsSmallInt(-AS_INT(operand))) {
+            discardLiteral(operandStart);
+            emitLiteral(INT_VAL(-AS_INT(operand)));
+            return;
+        }
+        if (IS_NUMBER(operand)) {
+            discardLiteral(operandStart);
+            emitLiteral(NUMBER_VAL(-AS_NUMBER(operand)));
+            return;
+        }
+    }
+
     switch (operatorType) {
     case TOKEN_BANG:
-        emitByte(OP_NOT);
+        // Remember `!!x` for conditions, which only need its truthiness
+        if (current->lastNot != SIZE_MAX && current->lastNot + 1U == currentChunk()->count) {
+            current->doubleNotEnd = currentChunk()->count + 1U;
+        }
+        emitNot();
         break;
     case TOKEN_MINUS:
         emitByte(OP_NEGATE);
@@ -459,9 +915,12 @@ static void unary(bool canAssign) {
 static ParseRule const rules[] = {
     [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL},
     [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACE] = {map, NULL, PREC_NONE},
     [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACKET] = {list, subscript, PREC_CALL},
+    [TOKEN_RIGHT_BRACKET] = {NULL, NULL, PREC_NONE},
     [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
+    [TOKEN_COLON] = {NULL, NULL, PREC_NONE},
     [TOKEN_DOT] = {NULL, dot, PREC_CALL},
     [TOKEN_MINUS] = {unary, binary, PREC_TERM},
     [TOKEN_PLUS] = {NULL, binary, PREC_TERM},
@@ -486,6 +945,7 @@ static ParseRule const rules[] = {
     [TOKEN_FOR] = {NULL, NULL, PREC_NONE},
     [TOKEN_FUN] = {NULL, NULL, PREC_NONE},
     [TOKEN_IF] = {NULL, NULL, PREC_NONE},
+    [TOKEN_IN] = {NULL, NULL, PREC_NONE},
     [TOKEN_NIL] = {literal, NULL, PREC_NONE},
     [TOKEN_OR] = {NULL, or_, PREC_OR},
     [TOKEN_PRINT] = {NULL, NULL, PREC_NONE},
@@ -511,11 +971,13 @@ static void parsePrecedence(Precedence precedence) {
         return;
     }
     bool const canAssign = precedence <= PREC_ASSIGNMENT;
+    usize const start = currentChunk()->count;
     prefixRule(canAssign);
 
     while (precedence <= getRule(parser.current.type)->precedence) {
         advance();
         ParseFn const infixRule = getRule(parser.previous.type)->infix;
+        parser.leftStart = start;
         infixRule(canAssign);
     }
 
@@ -524,7 +986,7 @@ static void parsePrecedence(Precedence precedence) {
     }
 }
 
-static u8 identifierConstant(Token *name) {
+static usize identifierConstant(Token *name) {
     return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
@@ -547,7 +1009,7 @@ static i32 resolveLocal(Compiler *compiler, Token *name) {
     return -1;
 }
 
-static i32 addUpvalue(Compiler *compiler, u8 index, bool isLocal) {
+static i32 addUpvalue(Compiler *compiler, u16 index, bool isLocal, bool byValue) {
     usize const upvalueCount = compiler->function->upvalueCount;
 
     for (usize i = 0; i < upvalueCount; ++i) {
@@ -557,39 +1019,87 @@ static i32 addUpvalue(Compiler *compiler, u8 index, bool isLocal) {
         }
     }
 
-    if (upvalueCount == UINT8_COUNT) {
+    if (upvalueCount == UINT16_COUNT) {
         error("Too many closure variables in function.");
         return 0;
     }
+    if (compiler->upvalueCapacity < upvalueCount + 1U) {
+        usize const oldCapacity = compiler->upvalueCapacity;
+        compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->upvalues = GROW_ARRAY(Upvalue, compiler->upvalues, oldCapacity, compiler->upvalueCapacity);
+    }
 
     compiler->upvalues[upvalueCount].isLocal = isLocal;
     compiler->upvalues[upvalueCount].index = index;
+    compiler->upvalues[upvalueCount].byValue = byValue;
     return (i32)compiler->function->upvalueCount++;
 }
 
+// Scans the rest of the local's scope for an assignment to it. The scan is
+// purely lexical and therefore conservative: shadowing declarations with the
+// same name just make the variable look mutable.
+static bool isAssignedAhead(Local const *local) {
+    Scanner const saved = saveScanner();
+    i32 depth = parser.braceDepth;
+    TokenType beforePrevious = TOKEN_ERROR;
+    Token previous = parser.previous;
+    Token token = parser.current;
+    bool assigned = false;
+    while (token.type != TOKEN_EOF) {
+        if (token.type == TOKEN_LEFT_BRACE) {
+            ++depth;
+        } else if (token.type == TOKEN_RIGHT_BRACE && --depth < local->braceDepth) {
+            break;
+        }
+        if (token.type == TOKEN_EQUAL
+            && previous.type == TOKEN_IDENTIFIER
+            && beforePrevious != TOKEN_DOT
+            && beforePrevious != TOKEN_VAR
+            && identifiersEqual(&previous, &local->name)) {
+            assigned = true;
+            break;
+        }
+        beforePrevious = previous.type;
+        previous = token;
+        token = scanToken();
+    }
+    restoreScanner(saved);
+    return assigned;
+}
+
+static void resolveCapture(Local *local) {
+    if (local->capture != CAPTURE_NONE) { return; }
+    local->capture = local->isAssigned || isAssignedAhead(local)
+                         ? CAPTURE_BY_REFERENCE
+                         : CAPTURE_BY_VALUE;
+}
+
 static i32 resolveUpvalue(Compiler *compiler, Token *name) {
     if (compiler->enclosing == NULL) { return -1; }
     i32 const local = resolveLocal(compiler->enclosing, name);
     if (local != -1) {
-        compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (u8)local, true);
+        Local *captured = &compiler->enclosing->locals[local];
+        resolveCapture(captured);
+        return addUpvalue(compiler, (u16)local, true, captured->capture == CAPTURE_BY_VALUE);
     }
     i32 const upvalue = resolveUpvalue(compiler->enclosing, name);
     if (upvalue != -1) {
-        return addUpvalue(compiler, (u8)upvalue, false);
+        return addUpvalue(compiler, (u16)upvalue, false, compiler->enclosing->upvalues[upvalue].byValue);
     }
     return -1;
 }
 
 static void addLocal(Token name) {
-    if (current->localCount == UINT8_COUNT) {
+    if (current->localCount == UINT16_COUNT) {
         error("Too many local variables in function.");
         return;
     }
-    Local *local = &current->locals[current->localCount++];
+    Local *local = pushLocal(current);
     local->name = name;
     local->depth = -1;
-    local->isCaptured = false;
+    local->braceDepth = parser.braceDepth;
+    local->capture = CAPTURE_NONE;
+    local->isAssigned = false;
 }
 
 static void declareVariable(void) {
@@ -608,7 +1118,7 @@ static void declareVariable(void) {
     addLocal(*name);
 }
 
-static u8 parseVariable(const char *errorMessage) {
+static usize parseVariable(const char *errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
 
     declareVariable();
@@ -624,12 +1134,12 @@ static void markInitialized(void) {
     current->locals[current->localCount - 1U].depth = current->scopeDepth;
 }
 
-static void defineVariable(u8 global) {
+static void defineVariable(usize global) {
     if (current->scopeDepth > 0) {
         markInitialized();
         return;
     }
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitIndexed(OP_DEFINE_GLOBAL, global);
 }
 
 static u8 argumentList(void) {
@@ -678,7 +1188,7 @@ static void function(FunctionType type) {
             if (current->function->arity > UINT8_MAX) {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
-            u8 const constant = parseVariable("Expect parameter name.");
+            usize const constant = parseVariable("Expect parameter name.");
             defineVariable(constant);
         } while (match(TOKEN_COMMA));
     }
@@ -687,32 +1197,46 @@ static void function(FunctionType type) {
     block();
 
     ObjFunction *function = endCompiler();
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    usize const constant = makeConstant(OBJ_VAL(function));
+    bool isWide = constant > UINT8_MAX;
+    for (usize i = 0; i < function->upvalueCount; ++i) {
+        if (compiler.upvalues[i].index > UINT8_MAX) { isWide = true; }
+    }
+    if (isWide) {
+        emitBytes(OP_WIDE, OP_CLOSURE);
+        emitBytes((u8)(constant >> 8U), (u8)constant);
+    } else {
+        emitBytes(OP_CLOSURE, (u8)constant);
+    }
 
     for (usize i = 0; i < function->upvalueCount; ++i) {
-        emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emitByte(compiler.upvalues[i].index);
+        u8 flags = compiler.upvalues[i].isLocal ? (u8)UPVALUE_LOCAL : 0U;
+        if (compiler.upvalues[i].byValue) { flags |= UPVALUE_BY_VALUE; }
+        emitByte(flags);
+        if (isWide) { emitByte((u8)(compiler.upvalues[i].index >> 8U)); }
+        emitByte((u8)compiler.upvalues[i].index);
     }
+    FREE_ARRAY(Upvalue, compiler.upvalues, compiler.upvalueCapacity);
 }
 
 static void method(void) {
     consume(TOKEN_IDENTIFIER, "Expect method name.");
-    u8 const constant = identifierConstant(&parser.previous);
+    usize const constant = identifierConstant(&parser.previous);
     FunctionType type = TYPE_METHOD;
     if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0) {
         type = TYPE_INITIALIZER;
     }
     function(type);
-    emitBytes(OP_METHOD, constant);
+    emitIndexed(OP_METHOD, constant);
 }
 
 static void classDeclaration(void) {
     consume(TOKEN_IDENTIFIER, "Expect class name.");
     Token const className = parser.previous;
-    u8 const nameConstant = identifierConstant(&parser.previous);
+    usize const nameConstant = identifierConstant(&parser.previous);
     declareVariable();
 
-    emitBytes(OP_CLASS, nameConstant);
+    emitIndexed(OP_CLASS, nameConstant);
     defineVariable(nameConstant);
 
     ClassCompiler classCompiler;
@@ -741,7 +1265,7 @@ static void classDeclaration(void) {
         method();
     }
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
-    emitByte(OP_POP);
+    emitByte(OP_END_CLASS);
 
     if (classCompiler.hasSuperclass) {
         endScope();
@@ -751,7 +1275,7 @@ static void classDeclaration(void) {
 }
 
 static void funDeclaration(void) {
-    u8 const global = parseVariable("Expect function name.");
+    usize const global = parseVariable("Expect function name.");
     // mark initialized here to allow recursion
     markInitialized();
     function(TYPE_FUNCTION);
@@ -759,7 +1283,7 @@ static void funDeclaration(void) {
 }
 
 static void varDeclaration(void) {
-    u8 const global = parseVariable("Expect variable name.");
+    usize const global = parseVariable("Expect variable name.");
     if (match(TOKEN_EQUAL)) {
         expression();
     } else {
@@ -769,9 +1293,19 @@ static void varDeclaration(void) {
     defineVariable(global);
 }
 
+// Conditions only need truthiness, so `!!x` can test x directly
+static void condition(void) {
+    expression();
+    if (current->doubleNotEnd == currentChunk()->count) {
+        currentChunk()->count -= 2U;
+        current->lastNot = SIZE_MAX;
+        current->doubleNotEnd = SIZE_MAX;
+    }
+}
+
 static void ifStatement(void) {
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-    expression();
+    condition();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after consition.");
 
     usize const thenJump = emitJump(OP_JUMP_IF_FALSE);
@@ -795,13 +1329,64 @@ static void expressionStatement(void) {
     emitByte(OP_POP);
 }
 
+// Whether the current token is the variable of a for-in loop
+static bool checkForIn(void) {
+    if (!check(TOKEN_IDENTIFIER)) { return false; }
+    Scanner const saved = saveScanner();
+    bool const isIn = scanToken().type == TOKEN_IN;
+    restoreScanner(saved);
+    return isIn;
+}
+
+// The sequence and the iteration state live in two hidden locals. Each
+// OP_FOR_ITER pushes the next element, which becomes the loop variable of
+// that iteration only, or jumps past the loop.
+static void forInStatement(void) {
+    consume(TOKEN_IDENTIFIER, "Expect loop variable name.");
+    Token const name = parser.previous;
+    consume(TOKEN_IN, "Expect 'in' after loop variable.");
+    expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+    addLocal(syntheticToken("for sequence"));
+    markInitialized();
+    emitByte(OP_NIL);
+    addLocal(syntheticToken("for state"));
+    markInitialized();
+
+    usize const loopStart = currentChunk()->count;
+    usize const slot = current->localCount - 2U;
+    emitIndexed(OP_FOR_ITER, slot);
+    usize const exitJump = currentChunk()->count;
+    emitBytes(0xFF, 0xFF);  // NOLINT
+    if (slot > UINT8_MAX) { emitBytes(0xFF, 0xFF); }  // NOLINT
+
+    beginScope();
+    addLocal(name);
+    markInitialized();
+    statement();
+    endScope();
+    emitLoop(loopStart);
+    if (slot > UINT8_MAX) {
+        patchWideJump(exitJump);
+    } else {
+        patchJump(exitJump);
+    }
+}
+
 static void forStatement(void) {
     beginScope();
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-    if (match(TOKEN_SEMICOLON)) {
-        // No initilaizer
-    } else if (match(TOKEN_VAR)) {
+    bool const hasVar = match(TOKEN_VAR);
+    if (checkForIn()) {
+        forInStatement();
+        endScope();
+        return;
+    }
+    if (hasVar) {
         varDeclaration();
+    } else if (match(TOKEN_SEMICOLON)) {
+        // No initilaizer
     } else {
         expressionStatement();
     }
@@ -816,7 +1401,7 @@ static void forStatement(void) {
     usize loopStart = currentChunk()->count;
     usize exitJump = SIZE_MAX;
     if (!match(TOKEN_SEMICOLON)) {
-        expression();
+        condition();
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
         exitJump = emitJump(OP_JUMP_IF_FALSE);
         emitByte(OP_POP);
@@ -869,7 +1454,7 @@ static void returnStatement(void) {
 static void whileStatement(void) {
     usize const loopStart = currentChunk()->count;
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-    expression();
+    condition();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
     usize const exitJump = emitJump(OP_JUMP_IF_FALSE);
@@ -940,12 +1525,13 @@ static void statement(void) {
 
 ObjFunction *compile(const char *source) {
     initScanner(source);
-    Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
-
+    parser.braceDepth = 0;
     parser.hadError = false;
     parser.panicMode = false;
 
+    Compiler compiler;
+    initCompiler(&compiler, TYPE_SCRIPT);
+
     advance();
 
     while (!match(TOKEN_EOF)) {
@@ -953,7 +1539,14 @@ ObjFunction *compile(const char *source) {
     }
 
     ObjFunction *function = endCompiler();
-    return parser.hadError ? NULL : function;
+    FREE_ARRAY(Upvalue, compiler.upvalues, compiler.upvalueCapacity);
+    if (parser.hadError) { return NULL; }
+    if (optimizing) { optimizeProgram(function); }
+    return function;
+}
+
+void setOptimizing(bool enabled) {
+    optimizing = enabled;
 }
 
 void markCompilerRoots(void) {
@@ -6,6 +6,7 @@
 #include <stdbool.h>  // NOLINT
 
 ObjFunction *compile(const char *source);
+void setOptimizing(bool enabled);
 void markCompilerRoots(void);
 
 #endif
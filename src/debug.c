@@ -23,6 +23,14 @@ static usize jumpInstruction(const char *name, i32 sign, Chunk const *chunk, usi
     return offset + 3U;
 }
 
+static usize forIterInstruction(Chunk const *chunk, usize offset) {
+    u8 const slot = chunk->code[offset + 1U];
+    u16 jump = (u16)(chunk->code[offset + 2U] << 8U);  // NOLINT
+    jump |= chunk->code[offset + 3U];
+    printf("%-16s %4u -> %lu\n", "OP_FOR_ITER", slot, offset + 4U + jump);
+    return offset + 4U;
+}
+
 static usize constantInstruction(const char *name, Chunk const *chunk, usize offset) {
     u8 const constant = chunk->code[offset + 1U];
     printf("%-16s %4d '", name, constant);
@@ -40,6 +48,125 @@ static usize invokeInstruction(const char *name, Chunk const *chunk, usize offse
     return offset + 3U;
 }
 
+static usize guardInstruction(Chunk const *chunk, usize offset) {
+    u8 const constant = chunk->code[offset + 1U];
+    u8 const argCount = chunk->code[offset + 2U];
+    u16 jump = (u16)(chunk->code[offset + 3U] << 8U);  // NOLINT
+    jump |= chunk->code[offset + 4U];
+    printf("%-16s (%d args) %4d '", "OP_GUARD_CALLEE", argCount, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' -> %lu\n", offset + 5U + jump);
+    return offset + 5U;
+}
+
+static usize wideIndex(Chunk const *chunk, usize offset) {
+    return (usize)chunk->code[offset] << 8U | chunk->code[offset + 1U];
+}
+
+static usize wideJump(Chunk const *chunk, usize offset) {
+    return wideIndex(chunk, offset) << 16U | wideIndex(chunk, offset + 2U);
+}
+
+static usize wideConstantInstruction(const char *name, Chunk const *chunk, usize offset) {
+    usize const constant = wideIndex(chunk, offset + 2U);
+    printf("%-16s %4zu '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4U;
+}
+
+static usize wideSlotInstruction(const char *name, Chunk const *chunk, usize offset) {
+    printf("%-16s %4zu\n", name, wideIndex(chunk, offset + 2U));
+    return offset + 4U;
+}
+
+static usize wideJumpInstruction(const char *name, i32 sign, Chunk const *chunk, usize offset) {
+    usize const jump = wideJump(chunk, offset + 2U);
+    printf("%-16s %4lu -> %lu\n", name, offset, sign > 0 ? offset + 6U + jump : offset + 6U - jump);
+    return offset + 6U;
+}
+
+static usize wideInvokeInstruction(const char *name, Chunk const *chunk, usize offset) {
+    usize const constant = wideIndex(chunk, offset + 2U);
+    u8 const argCount = chunk->code[offset + 4U];
+    printf("%-16s (%d args) %4zu '", name, argCount, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 5U;
+}
+
+// Wide instructions print with a W_ prefix on their name
+static usize wideInstruction(Chunk const *chunk, usize offset) {
+    u8 const instruction = chunk->code[offset + 1U];
+    switch (instruction) {
+    case OP_CONSTANT:
+        return wideConstantInstruction("W_OP_CONSTANT", chunk, offset);
+    case OP_DEFINE_GLOBAL:
+        return wideConstantInstruction("W_OP_DEFINE_GLOBAL", chunk, offset);
+    case OP_GET_GLOBAL:
+        return wideConstantInstruction("W_OP_GET_GLOBAL", chunk, offset);
+    case OP_SET_GLOBAL:
+        return wideConstantInstruction("W_OP_SET_GLOBAL", chunk, offset);
+    case OP_GET_LOCAL:
+        return wideSlotInstruction("W_OP_GET_LOCAL", chunk, offset);
+    case OP_SET_LOCAL:
+        return wideSlotInstruction("W_OP_SET_LOCAL", chunk, offset);
+    case OP_GET_UPVALUE:
+        return wideSlotInstruction("W_OP_GET_VALUE", chunk, offset);
+    case OP_SET_UPVALUE:
+        return wideSlotInstruction("W_OP_SET_VALUE", chunk, offset);
+    case OP_GET_FLAT_UPVALUE:
+        return wideSlotInstruction("W_OP_GET_FLAT_UPVALUE", chunk, offset);
+    case OP_JUMP_IF_FALSE:
+        return wideJumpInstruction("W_OP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_JUMP:
+        return wideJumpInstruction("W_OP_JUMP", 1, chunk, offset);
+    case OP_LOOP:
+        return wideJumpInstruction("W_OP_LOOP", -1, chunk, offset);
+    case OP_FOR_ITER: {
+        usize const slot = wideIndex(chunk, offset + 2U);
+        printf("%-16s %4zu -> %lu\n", "W_OP_FOR_ITER", slot, offset + 8U + wideJump(chunk, offset + 4U));
+        return offset + 8U;
+    }
+    case OP_CLOSURE: {
+        usize const constant = wideIndex(chunk, offset + 2U);
+        offset += 4U;
+        printf("%-16s %4zu ", "W_OP_CLOSURE", constant);
+        printValue(chunk->constants.values[constant]);
+        printf("\n");
+        ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+        for (usize j = 0; j < function->upvalueCount; ++j) {
+            u8 const flags = chunk->code[offset];
+            usize const index = wideIndex(chunk, offset + 1U);
+            printf("%04lu      |                     %s %zu%s\n",
+                   offset,
+                   (flags & UPVALUE_LOCAL) ? "local" : "upvalue",
+                   index,
+                   (flags & UPVALUE_BY_VALUE) ? " (value)" : "");
+            offset += 3U;
+        }
+        return offset;
+    }
+    case OP_CLASS:
+        return wideConstantInstruction("W_OP_CLASS", chunk, offset);
+    case OP_GET_PROPERTY:
+        return wideConstantInstruction("W_OP_GET_PROPERTY", chunk, offset);
+    case OP_SET_PROPERTY:
+        return wideConstantInstruction("W_OP_SET_PROPERTY", chunk, offset);
+    case OP_METHOD:
+        return wideConstantInstruction("W_OP_METHOD", chunk, offset);
+    case OP_INVOKE:
+        return wideInvokeInstruction("W_OP_INVOKE", chunk, offset);
+    case OP_GET_SUPER:
+        return wideConstantInstruction("W_OP_GET_SUPER", chunk, offset);
+    case OP_SUPER_INVOKE:
+        return wideInvokeInstruction("W_OP_SUPER_INVOKE", chunk, offset);
+    default:
+        printf("Unknown wide opcode %d\n", (i32)instruction);
+        return offset + 2U;
+    }
+}
+
 void disassembleChunk(Chunk const *chunk, const char *name) {
     printf("== %s ==\n", name);
     for (usize offset = 0; offset < chunk->count;) {
@@ -102,12 +229,16 @@ usize disassembleInstruction(Chunk const *chunk, usize offset) {
         return byteInstruction("OP_GET_VALUE", chunk, offset);
     case OP_SET_UPVALUE:
         return byteInstruction("OP_SET_VALUE", chunk, offset);
+    case OP_GET_FLAT_UPVALUE:
+        return byteInstruction("OP_GET_FLAT_UPVALUE", chunk, offset);
     case OP_JUMP_IF_FALSE:
         return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
     case OP_JUMP:
         return jumpInstruction("OP_JUMP", 1, chunk, offset);
     case OP_LOOP:
         return jumpInstruction("OP_LOOP", -1, chunk, offset);
+    case OP_FOR_ITER:
+        return forIterInstruction(chunk, offset);
     case OP_CALL:
         return byteInstruction("OP_CALL", chunk, offset);
     case OP_CLOSURE: {
@@ -118,9 +249,13 @@ usize disassembleInstruction(Chunk const *chunk, usize offset) {
         printf("\n");
         ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
         for (usize j = 0; j < function->upvalueCount; ++j) {
-            i32 const isLocal = chunk->code[offset++];
+            u8 const flags = chunk->code[offset++];
             i32 const index = chunk->code[offset++];
-            printf("%04lu      |                     %s %d\n", offset - 2U, isLocal ? "local" : "upvalue", index);
+            printf("%04lu      |                     %s %d%s\n",
+                   offset - 2U,
+                   (flags & UPVALUE_LOCAL) ? "local" : "upvalue",
+                   index,
+                   (flags & UPVALUE_BY_VALUE) ? " (value)" : "");
         }
         return offset;
     }
@@ -132,16 +267,32 @@ usize disassembleInstruction(Chunk const *chunk, usize offset) {
         return constantInstruction("OP_GET_PROPERTY", chunk, offset);
     case OP_SET_PROPERTY:
         return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+    case OP_LIST:
+        return byteInstruction("OP_LIST", chunk, offset);
+    case OP_MAP:
+        return byteInstruction("OP_MAP", chunk, offset);
+    case OP_GET_INDEX:
+        return simpleInstruction("OP_GET_INDEX", offset);
+    case OP_SET_INDEX:
+        return simpleInstruction("OP_SET_INDEX", offset);
     case OP_METHOD:
         return constantInstruction("OP_METHOD", chunk, offset);
     case OP_INVOKE:
         return invokeInstruction("OP_INVOKE", chunk, offset);
+    case OP_END_CLASS:
+        return simpleInstruction("OP_END_CLASS", offset);
     case OP_INHERIT:
         return simpleInstruction("OP_INHERIT", offset);
     case OP_GET_SUPER:
         return constantInstruction("OP_GET_SUPER", chunk, offset);
     case OP_SUPER_INVOKE:
         return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+    case OP_GUARD_CALLEE:
+        return guardInstruction(chunk, offset);
+    case OP_INLINE_RETURN:
+        return byteInstruction("OP_INLINE_RETURN", chunk, offset);
+    case OP_WIDE:
+        return wideInstruction(chunk, offset);
     }
     printf("Unknown opcode %d\n", (i32)instruction);
     return offset + 1U;
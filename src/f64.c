@@ -0,0 +1,172 @@
+#include "f64.h"
+
+#include "common.h"
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAS_X86_SIMD
+#endif
+
+static void addScalar(double *dest, const double *a, const double *b, usize length) {
+    for (usize i = 0; i < length; ++i) { dest[i] = a[i] + b[i]; }
+}
+
+static void mulScalar(double *dest, const double *a, const double *b, usize length) {
+    for (usize i = 0; i < length; ++i) { dest[i] = a[i] * b[i]; }
+}
+
+// Not fused: the AVX2 version may differ in the last bit
+static void fmaScalar(double *dest, const double *a, const double *b, const double *c, usize length) {
+    for (usize i = 0; i < length; ++i) { dest[i] = a[i] * b[i] + c[i]; }
+}
+
+static void scaleScalar(double *dest, const double *a, double factor, usize length) {
+    for (usize i = 0; i < length; ++i) { dest[i] = a[i] * factor; }
+}
+
+static double sumScalar(const double *a, usize length) {
+    double sum = 0.0;
+    for (usize i = 0; i < length; ++i) { sum += a[i]; }
+    return sum;
+}
+
+static double dotScalar(const double *a, const double *b, usize length) {
+    double sum = 0.0;
+    for (usize i = 0; i < length; ++i) { sum += a[i] * b[i]; }
+    return sum;
+}
+
+// Written as (x < y ? x : y) to treat NaN the way minpd does
+static double minScalar(const double *a, usize length) {
+    double min = a[0];
+    for (usize i = 1; i < length; ++i) { min = a[i] < min ? a[i] : min; }
+    return min;
+}
+
+static double maxScalar(const double *a, usize length) {
+    double max = a[0];
+    for (usize i = 1; i < length; ++i) { max = a[i] > max ? a[i] : max; }
+    return max;
+}
+
+#ifdef HAS_X86_SIMD
+
+#define AVX2 __attribute__((target("avx2,fma")))
+
+AVX2 static void addAvx2(double *dest, const double *a, const double *b, usize length) {
+    usize i = 0;
+    for (; i + 4U <= length; i += 4U) {
+        _mm256_storeu_pd(dest + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    }
+    addScalar(dest + i, a + i, b + i, length - i);
+}
+
+AVX2 static void mulAvx2(double *dest, const double *a, const double *b, usize length) {
+    usize i = 0;
+    for (; i + 4U <= length; i += 4U) {
+        _mm256_storeu_pd(dest + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    }
+    mulScalar(dest + i, a + i, b + i, length - i);
+}
+
+AVX2 static void fmaAvx2(double *dest, const double *a, const double *b, const double *c, usize length) {
+    usize i = 0;
+    for (; i + 4U <= length; i += 4U) {
+        __m256d const product = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), _mm256_loadu_pd(c + i));
+        _mm256_storeu_pd(dest + i, product);
+    }
+    fmaScalar(dest + i, a + i, b + i, c + i, length - i);
+}
+
+AVX2 static void scaleAvx2(double *dest, const double *a, double factor, usize length) {
+    usize i = 0;
+    __m256d const factors = _mm256_set1_pd(factor);
+    for (; i + 4U <= length; i += 4U) {
+        _mm256_storeu_pd(dest + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), factors));
+    }
+    scaleScalar(dest + i, a + i, factor, length - i);
+}
+
+AVX2 static double horizontalSum(__m256d v) {
+    __m128d const pairs = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(pairs, _mm_unpackhi_pd(pairs, pairs)));
+}
+
+// Two accumulators hide the latency of the additions
+AVX2 static double sumAvx2(const double *a, usize length) {
+    usize i = 0;
+    __m256d first = _mm256_setzero_pd();
+    __m256d second = _mm256_setzero_pd();
+    for (; i + 8U <= length; i += 8U) {
+        first = _mm256_add_pd(first, _mm256_loadu_pd(a + i));
+        second = _mm256_add_pd(second, _mm256_loadu_pd(a + i + 4U));
+    }
+    return horizontalSum(_mm256_add_pd(first, second)) + sumScalar(a + i, length - i);
+}
+
+AVX2 static double dotAvx2(const double *a, const double *b, usize length) {
+    usize i = 0;
+    __m256d first = _mm256_setzero_pd();
+    __m256d second = _mm256_setzero_pd();
+    for (; i + 8U <= length; i += 8U) {
+        first = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), first);
+        second = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 4U), _mm256_loadu_pd(b + i + 4U), second);
+    }
+    return horizontalSum(_mm256_add_pd(first, second)) + dotScalar(a + i, b + i, length - i);
+}
+
+AVX2 static double minAvx2(const double *a, usize length) {
+    if (length < 8U) { return minScalar(a, length); }
+    __m256d min = _mm256_loadu_pd(a);
+    usize i = 4;
+    for (; i + 4U <= length; i += 4U) { min = _mm256_min_pd(_mm256_loadu_pd(a + i), min); }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, min);
+    double result = minScalar(lanes, 4);
+    for (; i < length; ++i) { result = a[i] < result ? a[i] : result; }
+    return result;
+}
+
+AVX2 static double maxAvx2(const double *a, usize length) {
+    if (length < 8U) { return maxScalar(a, length); }
+    __m256d max = _mm256_loadu_pd(a);
+    usize i = 4;
+    for (; i + 4U <= length; i += 4U) { max = _mm256_max_pd(_mm256_loadu_pd(a + i), max); }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, max);
+    double result = maxScalar(lanes, 4);
+    for (; i < length; ++i) { result = a[i] > result ? a[i] : result; }
+    return result;
+}
+
+#undef AVX2
+
+#endif
+
+F64Kernels f64Kernels = {  // NOLINT
+    .add = addScalar,
+    .mul = mulScalar,
+    .fma = fmaScalar,
+    .scale = scaleScalar,
+    .sum = sumScalar,
+    .dot = dotScalar,
+    .min = minScalar,
+    .max = maxScalar,
+};
+
+void selectF64Kernels(void) {
+#ifdef HAS_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        f64Kernels = (F64Kernels){
+            .add = addAvx2,
+            .mul = mulAvx2,
+            .fma = fmaAvx2,
+            .scale = scaleAvx2,
+            .sum = sumAvx2,
+            .dot = dotAvx2,
+            .min = minAvx2,
+            .max = maxAvx2,
+        };
+    }
+#endif
+}
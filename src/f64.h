@@ -0,0 +1,22 @@
+#ifndef CLOX_F64_H
+#define CLOX_F64_H
+
+#include "common.h"
+
+// Bulk kernels over double arrays. dest may alias either operand.
+typedef struct {
+    void (*add)(double *dest, const double *a, const double *b, usize length);
+    void (*mul)(double *dest, const double *a, const double *b, usize length);
+    void (*fma)(double *dest, const double *a, const double *b, const double *c, usize length);
+    void (*scale)(double *dest, const double *a, double factor, usize length);
+    double (*sum)(const double *a, usize length);
+    double (*dot)(const double *a, const double *b, usize length);
+    double (*min)(const double *a, usize length);
+    double (*max)(const double *a, usize length);
+} F64Kernels;
+
+extern F64Kernels f64Kernels;
+
+void selectF64Kernels(void);
+
+#endif
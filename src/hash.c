@@ -0,0 +1,107 @@
+#include "hash.h"
+
+#include "common.h"
+#include <string.h>
+
+// wyhash (final version 4, public domain): the input is consumed eight bytes
+// at a time and mixed with 64x64->128 bit multiplications.
+
+// NOLINTBEGIN(readability-magic-numbers)
+static u64 const secret[4] = {
+    0xa0761d6478bd642fU,
+    0xe7037ed1a0b428dbU,
+    0x8ebc6af09c88c6e3U,
+    0x589965cc75374cc3U,
+};
+
+static inline void mum(u64 *a, u64 *b) {
+#ifdef __SIZEOF_INT128__
+    __extension__ typedef unsigned __int128 u128;
+    u128 const r = (u128)*a * *b;
+    *a = (u64)r;
+    *b = (u64)(r >> 64U);
+#else
+    u64 const ha = *a >> 32U;
+    u64 const hb = *b >> 32U;
+    u64 const la = (u32)*a;
+    u64 const lb = (u32)*b;
+    u64 const rh = ha * hb;
+    u64 const rm0 = ha * lb;
+    u64 const rm1 = hb * la;
+    u64 const rl = la * lb;
+    u64 const t = rl + (rm0 << 32U);
+    u64 carry = t < rl ? 1U : 0U;
+    u64 const lo = t + (rm1 << 32U);
+    carry += lo < t ? 1U : 0U;
+    *a = lo;
+    *b = rh + (rm0 >> 32U) + (rm1 >> 32U) + carry;
+#endif
+}
+
+static inline u64 mix(u64 a, u64 b) {
+    mum(&a, &b);
+    return a ^ b;
+}
+
+static inline u64 read8(const u8 *p) {
+    u64 v;  // NOLINT
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline u64 read4(const u8 *p) {
+    u32 v;  // NOLINT
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline u64 read3(const u8 *p, usize k) {
+    return ((u64)p[0] << 16U) | ((u64)p[k >> 1U] << 8U) | p[k - 1U];
+}
+
+u32 hashString(const char *key, usize length) {
+    const u8 *p = (const u8 *)key;
+    u64 seed = mix(secret[0], secret[1]);
+    u64 a;  // NOLINT
+    u64 b;  // NOLINT
+    if (length <= 16) {
+        if (length >= 4) {
+            usize const shift = (length >> 3U) << 2U;
+            a = (read4(p) << 32U) | read4(p + shift);
+            b = (read4(p + length - 4U) << 32U) | read4(p + length - 4U - shift);
+        } else if (length > 0) {
+            a = read3(p, length);
+            b = 0;
+        } else {
+            a = 0;
+            b = 0;
+        }
+    } else {
+        usize i = length;
+        if (i > 48) {
+            u64 see1 = seed;
+            u64 see2 = seed;
+            do {
+                seed = mix(read8(p) ^ secret[1], read8(p + 8) ^ seed);
+                see1 = mix(read8(p + 16) ^ secret[2], read8(p + 24) ^ see1);
+                see2 = mix(read8(p + 32) ^ secret[3], read8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = mix(read8(p) ^ secret[1], read8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = read8(p + i - 16);
+        b = read8(p + i - 8);
+    }
+    a ^= secret[1];
+    b ^= seed;
+    mum(&a, &b);
+    u64 const hash = mix(a ^ secret[0] ^ length, b ^ secret[1]);
+    return (u32)(hash ^ (hash >> 32U));
+}
+// NOLINTEND(readability-magic-numbers)
@@ -0,0 +1,8 @@
+#ifndef CLOX_HASH_H
+#define CLOX_HASH_H
+
+#include "common.h"
+
+u32 hashString(const char *key, usize length);
+
+#endif
@@ -1,4 +1,5 @@
 #include "common.h"
+#include "compiler.h"
 #include "vm.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -68,12 +69,18 @@ static void runFile(const char *path) {
 int main(int argc, const char **argv) {
     initVM();
 
-    if (argc == 1) {
+    i32 first = 1;
+    if (argc > 1 && strcmp(argv[1], "-O") == 0) {
+        setOptimizing(true);
+        ++first;
+    }
+
+    if (argc == first) {
         repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    } else if (argc == first + 1) {
+        runFile(argv[first]);
     } else {
-        i32 const hasError = fprintf(stderr, "Usage: clox [path]\n");
+        i32 const hasError = fprintf(stderr, "Usage: clox [-O] [path]\n");
         if (hasError < 0) {
             printf("Internal error in fprintf: %d\n", hasError);
         }
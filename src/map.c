@@ -0,0 +1,158 @@
+#include "map.h"
+#include "common.h"
+#include "hash.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+#include <stdint.h>
+#include <string.h>
+
+#define MAP_MAX_LOAD 0.75F
+
+void initMap(Map *map) {
+    map->count = 0;
+    map->capacity = 0;
+    map->entries = NULL;
+}
+
+void freeMap(Map *map) {
+    FREE_ARRAY(MapEntry, map->entries, map->capacity);
+    initMap(map);
+}
+
+static u32 mixBits(u64 bits) {
+    bits ^= bits >> 33U;
+    bits *= 0xFF51AFD7ED558CCDU;
+    bits ^= bits >> 33U;
+    return (u32)bits;
+}
+
+// The key must come from mapKey
+static u32 hashKey(Value key) {
+    if (IS_STRING(key)) { return AS_STRING(key)->hash; }
+    if (IS_OBJ(key)) { return mixBits((u64)(uintptr_t)AS_OBJ(key)); }
+    if (IS_BOOL(key)) { return AS_BOOL(key) ? 1U : 0U; }
+    // -0 and 0 are the same key
+    double const number = AS_NUMBER(key) + 0.0;
+    u64 bits;  // NOLINT
+    memcpy(&bits, &number, sizeof(bits));
+    return mixBits(bits);
+}
+
+static bool keysEqual(Value a, Value b) {
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wfloat-equal"
+        return AS_NUMBER(a) == AS_NUMBER(b);
+#pragma GCC diagnostic pop
+    }
+    if (IS_OBJ(a) && IS_OBJ(b)) { return AS_OBJ(a) == AS_OBJ(b); }
+    if (IS_BOOL(a) && IS_BOOL(b)) { return AS_BOOL(a) == AS_BOOL(b); }
+    return false;
+}
+
+bool isMapKey(Value key) {
+    if (IS_NUMBER(key)) {
+        double const number = AS_NUMBER(key);
+        return number >= 0.0 || number < 0.0;  // Not NaN
+    }
+    return !IS_NIL(key);
+}
+
+// Interns string keys, which may allocate. Other keys are returned as is.
+Value mapKey(Value key) {
+    if (!IS_ANY_STRING(key)) { return key; }
+    if (IS_STRING(key) && AS_STRING(key)->isInterned) { return key; }
+    Obj *string = AS_OBJ(key);
+    return OBJ_VAL(copyString(stringChars(string), stringLength(string)));
+}
+
+// Like mapKey but never allocates: a string that was never interned cannot
+// be a key, and comes back as nil.
+static Value findKey(Value key) {
+    if (!IS_ANY_STRING(key)) { return isMapKey(key) ? key : NIL_VAL; }
+    if (IS_STRING(key) && AS_STRING(key)->isInterned) { return key; }
+    Obj *string = AS_OBJ(key);
+    const char *chars = stringChars(string);
+    usize const length = stringLength(string);
+    ObjString *interned = tableFindString(&vm.strings, chars, length, hashString(chars, length));
+    return interned != NULL ? OBJ_VAL(interned) : NIL_VAL;
+}
+
+static MapEntry *findEntry(MapEntry *entries, usize capacity, Value key) {
+    usize index = hashKey(key) & (capacity - 1U);
+    while (true) {
+        MapEntry *entry = &entries[index];
+        if (IS_NIL(entry->key) || keysEqual(entry->key, key)) { return entry; }
+        index = (index + 1U) & (capacity - 1U);
+    }
+}
+
+static void adjustCapacity(Map *map, usize capacity) {
+    MapEntry *entries = ALLOCATE(MapEntry, capacity);
+    for (usize i = 0; i < capacity; ++i) {
+        entries[i].key = NIL_VAL;
+        entries[i].value = NIL_VAL;
+    }
+    for (usize i = 0; i < map->capacity; ++i) {
+        MapEntry const *entry = &map->entries[i];
+        if (IS_NIL(entry->key)) { continue; }
+        *findEntry(entries, capacity, entry->key) = *entry;
+    }
+    FREE_ARRAY(MapEntry, map->entries, map->capacity);
+    map->entries = entries;
+    map->capacity = capacity;
+}
+
+bool mapGet(Map const *map, Value key, Value *value) {
+    if (map->count == 0) { return false; }
+    key = findKey(key);
+    if (IS_NIL(key)) { return false; }
+    MapEntry const *entry = findEntry(map->entries, map->capacity, key);
+    if (IS_NIL(entry->key)) { return false; }
+    *value = entry->value;
+    return true;
+}
+
+// The key must come from mapKey and be reachable by the collector
+void mapSet(Map *map, Value key, Value value) {
+    if ((float)(map->count + 1U) > (float)map->capacity * MAP_MAX_LOAD) {
+        adjustCapacity(map, GROW_CAPACITY(map->capacity));
+    }
+    MapEntry *entry = findEntry(map->entries, map->capacity, key);
+    if (IS_NIL(entry->key)) { ++map->count; }
+    entry->key = key;
+    entry->value = value;
+}
+
+bool mapDelete(Map *map, Value key) {
+    if (map->count == 0) { return false; }
+    key = findKey(key);
+    if (IS_NIL(key)) { return false; }
+    MapEntry *entry = findEntry(map->entries, map->capacity, key);
+    if (IS_NIL(entry->key)) { return false; }
+
+    usize const mask = map->capacity - 1U;
+    usize hole = (usize)(entry - map->entries);
+    for (usize next = (hole + 1U) & mask; !IS_NIL(map->entries[next].key); next = (next + 1U) & mask) {
+        usize const home = hashKey(map->entries[next].key) & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            map->entries[hole] = map->entries[next];
+            hole = next;
+        }
+    }
+    map->entries[hole].key = NIL_VAL;
+    map->entries[hole].value = NIL_VAL;
+    --map->count;
+    return true;
+}
+
+void markMap(Map *map) {
+    for (usize i = 0; i < map->capacity; ++i) {
+        MapEntry const *entry = &map->entries[i];
+        if (IS_NIL(entry->key)) { continue; }
+        markValue(entry->key);
+        markValue(entry->value);
+    }
+}
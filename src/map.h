@@ -0,0 +1,31 @@
+#ifndef CLOX_MAP_H
+#define CLOX_MAP_H
+
+#include "common.h"
+#include "value.h"
+
+// Keys are numbers, booleans, strings or other objects by identity. A nil
+// key marks an empty slot. String keys are stored interned, so every key
+// compares by identity apart from numbers.
+typedef struct {
+    Value key;
+    Value value;
+} MapEntry;
+
+// Open addressing with linear probing and backward-shift deletion
+typedef struct {
+    usize count;
+    usize capacity;
+    MapEntry *entries;
+} Map;
+
+void initMap(Map *map);
+void freeMap(Map *map);
+bool isMapKey(Value key);
+Value mapKey(Value key);
+bool mapGet(Map const *map, Value key, Value *value);
+void mapSet(Map *map, Value key, Value value);
+bool mapDelete(Map *map, Value key);
+void markMap(Map *map);
+
+#endif
@@ -8,6 +8,11 @@
 #include "value.h"
 #include "vm.h"
 #include <stdlib.h>
+#include <string.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define HAS_MMAP
+#endif
 #ifdef DEBUG_LOG_GC
 #include "debug.h"
 #include <stdio.h>
@@ -36,6 +41,40 @@ void *reallocate(void *pointer, usize oldSize, usize newSize) {
     return result;
 }
 
+#ifdef HAS_MMAP
+// Large buffers are mapped, so freeing them returns the pages to the system
+#define MAPPED_MIN_SIZE (1024U * 1024U)
+#endif
+
+// Zero filled storage for byte buffers, counted towards the heap size
+void *allocateBuffer(usize size) {
+    if (size == 0) { return NULL; }
+#ifdef HAS_MMAP
+    if (size >= MAPPED_MIN_SIZE) {
+        void *buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED) { exit(1); }  // NOLINT
+        vm.bytesAllocated += size;
+        if (vm.bytesAllocated > vm.nextGC) { collectGarbage(); }
+        return buffer;
+    }
+#endif
+    void *buffer = reallocate(NULL, 0, size);
+    memset(buffer, 0, size);
+    return buffer;
+}
+
+void freeBuffer(void *buffer, usize size) {
+    if (size == 0) { return; }
+#ifdef HAS_MMAP
+    if (size >= MAPPED_MIN_SIZE) {
+        munmap(buffer, size);
+        vm.bytesAllocated -= size;
+        return;
+    }
+#endif
+    reallocate(buffer, size, 0);
+}
+
 void markObject(Obj *object) {
     if (object == NULL) { return; }
     if (object->isMarked) { return; }
@@ -83,6 +122,7 @@ static void blackenObject(Obj *object) {
     case OBJ_FUNCTION: {
         ObjFunction *function = (ObjFunction *)object;
         markObject((Obj *)function->name);
+        markObject((Obj *)function->closure);
         markArray(&function->chunk.constants);
         break;
     }
@@ -90,14 +130,16 @@ static void blackenObject(Obj *object) {
         ObjClosure *closure = (ObjClosure *)object;
         markObject((Obj *)closure->function);
         for (usize i = 0; i < closure->upvalueCount; ++i) {
-            markObject((Obj *)closure->upvalues[i]);
+            markValue(closure->upvalues[i]);
         }
         break;
     }
     case OBJ_CLASS: {
         ObjClass *klass = (ObjClass *)object;
         markObject((Obj *)klass->name);
+        markObject((Obj *)klass->initializer);
         markTable(&klass->methods);
+        markSealedTable(&klass->sealedMethods);
         break;
     }
     case OBJ_INSTANCE: {
@@ -112,6 +154,28 @@ static void blackenObject(Obj *object) {
         markObject((Obj *)bound->method);
         break;
     }
+    case OBJ_ROPE: {
+        ObjRope *rope = (ObjRope *)object;
+        markObject(rope->left);
+        markObject(rope->right);
+        markObject((Obj *)rope->flat);
+        break;
+    }
+    case OBJ_SLICE:
+        markObject((Obj *)((ObjSlice *)object)->parent);
+        break;
+    case OBJ_LIST:
+        markArray(&((ObjList *)object)->items);
+        break;
+    case OBJ_MAP:
+        markMap(&((ObjMap *)object)->entries);
+        break;
+    case OBJ_F64_ARRAY:
+    case OBJ_RANGE:
+        break;
+    case OBJ_BYTES:
+        markObject((Obj *)((ObjBytes *)object)->owner);
+        break;
     }
 }
 
@@ -122,8 +186,7 @@ static void freeObject(Obj *object) {
     switch (object->type) {
     case OBJ_STRING: {
         ObjString *string = (ObjString *)object;
-        FREE_ARRAY(char, string->chars, string->length + 1U);
-        FREE(ObjString, object);
+        reallocate(object, sizeof(ObjString) + string->length + 1U, 0);
         break;
     }
     case OBJ_FUNCTION: {
@@ -137,15 +200,16 @@ static void freeObject(Obj *object) {
         break;
     case OBJ_CLOSURE: {
         ObjClosure *closure = (ObjClosure *)object;
-        FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalueCount);
-        FREE(ObjClosure, object);
-    } break;
+        reallocate(object, sizeof(ObjClosure) + sizeof(Value) * closure->upvalueCount, 0);
+        break;
+    }
     case OBJ_UPVALUE:
         FREE(ObjUpvalue, object);
         break;
     case OBJ_CLASS: {
         ObjClass *klass = (ObjClass *)object;
         freeTable(&klass->methods);
+        freeSealedTable(&klass->sealedMethods);
         FREE(ObjClass, object);
         break;
     }
@@ -158,6 +222,34 @@ static void freeObject(Obj *object) {
     case OBJ_BOUND_METHOD:
         FREE(ObjBoundMethod, object);
         break;
+    case OBJ_ROPE:
+        FREE(ObjRope, object);
+        break;
+    case OBJ_SLICE:
+        FREE(ObjSlice, object);
+        break;
+    case OBJ_LIST:
+        freeValueArray(&((ObjList *)object)->items);
+        FREE(ObjList, object);
+        break;
+    case OBJ_MAP:
+        freeMap(&((ObjMap *)object)->entries);
+        FREE(ObjMap, object);
+        break;
+    case OBJ_F64_ARRAY: {
+        ObjF64Array const *array = (ObjF64Array const *)object;
+        reallocate(object, sizeof(ObjF64Array) + sizeof(double) * array->length, 0);
+        break;
+    }
+    case OBJ_BYTES: {
+        ObjBytes *bytes = (ObjBytes *)object;
+        if (bytes->owner == NULL) { freeBuffer(bytes->data, bytes->length); }
+        FREE(ObjBytes, object);
+        break;
+    }
+    case OBJ_RANGE:
+        FREE(ObjRange, object);
+        break;
     }
 }
 
@@ -176,9 +268,10 @@ static void markRoots(void) {
 
 
     markTable(&vm.globals);
+    markTable(&vm.assignedGlobals);
     markCompilerRoots();
-    vm.initString = NULL;  // Prevent GC to read garbage from initString if triggered from copyString
     markObject((Obj *)vm.initString);
+    markObject((Obj *)vm.nextString);
 }
 
 static void traceReferences(void) {
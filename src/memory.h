@@ -20,6 +20,10 @@
 
 void *reallocate(void *pointer, usize oldSize, usize newSize);
 
+void *allocateBuffer(usize size);
+
+void freeBuffer(void *buffer, usize size);
+
 void markObject(Obj *object);
 
 void markValue(Value value);
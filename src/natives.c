@@ -0,0 +1,907 @@
+#include "natives.h"
+
+#include "common.h"
+#include "f64.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#define HAS_POSIX_IO
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAS_X86_SIMD
+#endif
+
+// String scanning primitives. On x86-64 SSE2 is always available, AVX2 is
+// picked at startup when the CPU supports it. Other targets use the scalar
+// versions.
+
+typedef const char *(*FindFn)(const char *haystack, usize length, const char *needle, usize needleLength);
+typedef void (*ToUpperFn)(char *dest, const char *src, usize length);
+
+static const char *findScalar(const char *haystack, usize length, const char *needle, usize needleLength) {
+    if (needleLength == 0) { return haystack; }
+    if (needleLength > length) { return NULL; }
+    for (usize i = 0; i <= length - needleLength; ++i) {
+        if (haystack[i] == needle[0] && memcmp(haystack + i + 1, needle + 1, needleLength - 1U) == 0) {
+            return haystack + i;
+        }
+    }
+    return NULL;
+}
+
+static void toUpperScalar(char *dest, const char *src, usize length) {
+    for (usize i = 0; i < length; ++i) {
+        char const c = src[i];
+        dest[i] = (c >= 'a' && c <= 'z') ? (char)(c - ('a' - 'A')) : c;
+    }
+}
+
+#ifdef HAS_X86_SIMD
+
+// Candidates must match both the first and the last byte of the needle
+// before the remaining bytes are compared.
+static const char *findSse2(const char *haystack, usize length, const char *needle, usize needleLength) {
+    if (needleLength == 0) { return haystack; }
+    if (needleLength > length) { return NULL; }
+    usize const lastStart = length - needleLength;
+    usize i = 0;
+    __m128i const first = _mm_set1_epi8(needle[0]);
+    __m128i const last = _mm_set1_epi8(needle[needleLength - 1U]);
+    for (; i + 16U <= lastStart + 1U; i += 16U) {
+        __m128i const blockFirst = _mm_loadu_si128((const __m128i *)(const void *)(haystack + i));
+        __m128i const blockLast = _mm_loadu_si128((const __m128i *)(const void *)(haystack + i + needleLength - 1U));
+        u32 mask = (u32)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(blockFirst, first), _mm_cmpeq_epi8(blockLast, last)));
+        while (mask != 0) {
+            usize const candidate = i + (usize)__builtin_ctz(mask);
+            if (memcmp(haystack + candidate, needle, needleLength) == 0) { return haystack + candidate; }
+            mask &= mask - 1U;
+        }
+    }
+    return findScalar(haystack + i, length - i, needle, needleLength);
+}
+
+__attribute__((target("avx2"))) static const char *findAvx2(const char *haystack, usize length, const char *needle, usize needleLength) {
+    if (needleLength == 0) { return haystack; }
+    if (needleLength > length) { return NULL; }
+    usize const lastStart = length - needleLength;
+    usize i = 0;
+    __m256i const first = _mm256_set1_epi8(needle[0]);
+    __m256i const last = _mm256_set1_epi8(needle[needleLength - 1U]);
+    for (; i + 32U <= lastStart + 1U; i += 32U) {
+        __m256i const blockFirst = _mm256_loadu_si256((const __m256i *)(const void *)(haystack + i));
+        __m256i const blockLast = _mm256_loadu_si256((const __m256i *)(const void *)(haystack + i + needleLength - 1U));
+        u32 mask = (u32)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(blockFirst, first), _mm256_cmpeq_epi8(blockLast, last)));
+        while (mask != 0) {
+            usize const candidate = i + (usize)__builtin_ctz(mask);
+            if (memcmp(haystack + candidate, needle, needleLength) == 0) { return haystack + candidate; }
+            mask &= mask - 1U;
+        }
+    }
+    return findSse2(haystack + i, length - i, needle, needleLength);
+}
+
+// Bytes >= 0x80 compare as negative, so only 'a'..'z' are changed
+static void toUpperSse2(char *dest, const char *src, usize length) {
+    usize i = 0;
+    __m128i const beforeA = _mm_set1_epi8('a' - 1);
+    __m128i const afterZ = _mm_set1_epi8('z' + 1);
+    __m128i const caseBit = _mm_set1_epi8('a' - 'A');
+    for (; i + 16U <= length; i += 16U) {
+        __m128i const block = _mm_loadu_si128((const __m128i *)(const void *)(src + i));
+        __m128i const isLower = _mm_and_si128(_mm_cmpgt_epi8(block, beforeA), _mm_cmplt_epi8(block, afterZ));
+        _mm_storeu_si128((__m128i *)(void *)(dest + i), _mm_sub_epi8(block, _mm_and_si128(isLower, caseBit)));
+    }
+    toUpperScalar(dest + i, src + i, length - i);
+}
+
+__attribute__((target("avx2"))) static void toUpperAvx2(char *dest, const char *src, usize length) {
+    usize i = 0;
+    __m256i const beforeA = _mm256_set1_epi8('a' - 1);
+    __m256i const afterZ = _mm256_set1_epi8('z' + 1);
+    __m256i const caseBit = _mm256_set1_epi8('a' - 'A');
+    for (; i + 32U <= length; i += 32U) {
+        __m256i const block = _mm256_loadu_si256((const __m256i *)(const void *)(src + i));
+        __m256i const isLower = _mm256_and_si256(_mm256_cmpgt_epi8(block, beforeA), _mm256_cmpgt_epi8(afterZ, block));
+        _mm256_storeu_si256((__m256i *)(void *)(dest + i), _mm256_sub_epi8(block, _mm256_and_si256(isLower, caseBit)));
+    }
+    toUpperSse2(dest + i, src + i, length - i);
+}
+
+#endif
+
+static FindFn findBytes = findScalar;  // NOLINT
+static ToUpperFn toUpperBytes = toUpperScalar;  // NOLINT
+
+static void selectStringKernels(void) {
+#ifdef HAS_X86_SIMD
+    findBytes = findSse2;
+    toUpperBytes = toUpperSse2;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        findBytes = findAvx2;
+        toUpperBytes = toUpperAvx2;
+    }
+#endif
+}
+
+static bool checkStrings(const char *name, Value const *args, i32 count) {
+    for (i32 i = 0; i < count; ++i) {
+        if (!IS_ANY_STRING(args[i])) {
+            runtimeError("%s() expects string arguments.", name);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static bool clockNative(i32 argCount, Value *args) {
+    (void)argCount;
+    args[-1] = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    return true;
+}
+
+// substring(string, start, end) -> characters in [start, end). The result
+// shares the characters of `string` instead of copying them.
+static bool substringNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (!IS_ANY_STRING(args[0])) {
+        runtimeError("substring() expects a string.");
+        return false;
+    }
+    usize const length = stringLength(AS_OBJ(args[0]));
+    usize start;  // NOLINT
+    usize end;  // NOLINT
+    if (!toIndex(args[1], &start) || !toIndex(args[2], &end) || start > end || end > length) {
+        runtimeError("substring() range out of bounds.");
+        return false;
+    }
+    args[-1] = OBJ_VAL(sliceString(AS_OBJ(args[0]), start, end - start));
+    return true;
+}
+
+static bool lenNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (IS_LIST(args[0])) {
+        args[-1] = INT_VAL((i64)AS_LIST(args[0])->items.count);
+        return true;
+    }
+    if (IS_MAP(args[0])) {
+        args[-1] = INT_VAL((i64)AS_MAP(args[0])->entries.count);
+        return true;
+    }
+    if (IS_F64_ARRAY(args[0])) {
+        args[-1] = INT_VAL((i64)AS_F64_ARRAY(args[0])->length);
+        return true;
+    }
+    if (IS_BYTES(args[0])) {
+        args[-1] = INT_VAL((i64)AS_BYTES(args[0])->length);
+        return true;
+    }
+    if (!IS_ANY_STRING(args[0])) {
+        runtimeError("len() expects a string, a list, a map, an array or bytes.");
+        return false;
+    }
+    args[-1] = INT_VAL((i64)stringLength(AS_OBJ(args[0])));
+    return true;
+}
+
+// Whether `value` is a whole number in the int range
+static bool toInt(Value value, i64 *integer) {
+    if (IS_INT(value)) {
+        *integer = AS_INT(value);
+        return true;
+    }
+    if (!IS_NUMBER(value)) { return false; }
+    double const number = AS_NUMBER(value);
+    if (!(number >= (double)SMALL_INT_MIN && number <= (double)SMALL_INT_MAX)) { return false; }
+    *integer = (i64)number;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wfloat-equal"
+    return (double)*integer == number;
+#pragma GCC diagnostic pop
+}
+
+// range(end), range(start, end) or range(start, end, step)
+static bool rangeNative(i32 argCount, Value *args) {
+    if (argCount < 1 || argCount > 3) {
+        runtimeError("Expected 1 to 3 arguments but got %d.", argCount);
+        return false;
+    }
+    i64 bounds[3] = {0, 0, 1};
+    i64 *first = argCount == 1 ? &bounds[1] : bounds;
+    for (i32 i = 0; i < argCount; ++i) {
+        if (!toInt(args[i], &first[i])) {
+            runtimeError("range() expects integers.");
+            return false;
+        }
+    }
+    if (bounds[2] == 0) {
+        runtimeError("range() step can't be 0.");
+        return false;
+    }
+    args[-1] = OBJ_VAL(newRange(bounds[0], bounds[1], bounds[2]));
+    return true;
+}
+
+// indexOf(string, needle[, from]) -> index of the first match or -1
+static bool indexOfNative(i32 argCount, Value *args) {
+    if (argCount != 2 && argCount != 3) {
+        runtimeError("Expected 2 or 3 arguments but got %d.", argCount);
+        return false;
+    }
+    if (!checkStrings("indexOf", args, 2)) { return false; }
+    usize const length = stringLength(AS_OBJ(args[0]));
+    usize from = 0;
+    if (argCount == 3 && (!toIndex(args[2], &from) || from > length)) {
+        runtimeError("indexOf() start out of bounds.");
+        return false;
+    }
+    const char *chars = stringChars(AS_OBJ(args[0]));
+    const char *needle = stringChars(AS_OBJ(args[1]));
+    const char *found = findBytes(chars + from, length - from, needle, stringLength(AS_OBJ(args[1])));
+    args[-1] = INT_VAL(found != NULL ? (i64)(found - chars) : -1);
+    return true;
+}
+
+static bool startsWithNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (!checkStrings("startsWith", args, 2)) { return false; }
+    usize const length = stringLength(AS_OBJ(args[0]));
+    usize const prefixLength = stringLength(AS_OBJ(args[1]));
+    const char *chars = stringChars(AS_OBJ(args[0]));
+    args[-1] = BOOL_VAL(prefixLength <= length && memcmp(chars, stringChars(AS_OBJ(args[1])), prefixLength) == 0);
+    return true;
+}
+
+// replace(string, pattern, replacement) replaces every occurrence
+static bool replaceNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (!checkStrings("replace", args, 3)) { return false; }
+    usize const length = stringLength(AS_OBJ(args[0]));
+    usize const patternLength = stringLength(AS_OBJ(args[1]));
+    usize const replacementLength = stringLength(AS_OBJ(args[2]));
+    if (patternLength == 0) {
+        args[-1] = args[0];
+        return true;
+    }
+
+    const char *chars = stringChars(AS_OBJ(args[0]));
+    const char *pattern = stringChars(AS_OBJ(args[1]));
+    const char *replacement = stringChars(AS_OBJ(args[2]));
+    usize matches = 0;
+    for (const char *at = chars; (at = findBytes(at, length - (usize)(at - chars), pattern, patternLength)) != NULL;) {
+        ++matches;
+        at += patternLength;
+    }
+    if (matches == 0) {
+        args[-1] = args[0];
+        return true;
+    }
+
+    // The arguments stay on the stack, so a collection here cannot move or
+    // free the characters being read.
+    ObjString *result = allocateString(length - matches * patternLength + matches * replacementLength);
+    char *dest = result->chars;
+    const char *from = chars;
+    for (usize i = 0; i < matches; ++i) {
+        const char *at = findBytes(from, length - (usize)(from - chars), pattern, patternLength);
+        memcpy(dest, from, (usize)(at - from));
+        dest += at - from;
+        memcpy(dest, replacement, replacementLength);
+        dest += replacementLength;
+        from = at + patternLength;
+    }
+    memcpy(dest, from, length - (usize)(from - chars));
+    args[-1] = OBJ_VAL(result);
+    return true;
+}
+
+// trim(string) -> the string without surrounding whitespace, as a slice
+static bool trimNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (!checkStrings("trim", args, 1)) { return false; }
+    usize const length = stringLength(AS_OBJ(args[0]));
+    const char *chars = stringChars(AS_OBJ(args[0]));
+    usize start = 0;
+    usize end = length;
+    while (start < end && isSpace(chars[start])) { ++start; }
+    while (end > start && isSpace(chars[end - 1U])) { --end; }
+    args[-1] = OBJ_VAL(sliceString(AS_OBJ(args[0]), start, end - start));
+    return true;
+}
+
+static bool toUpperNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (!checkStrings("toUpper", args, 1)) { return false; }
+    usize const length = stringLength(AS_OBJ(args[0]));
+    stringChars(AS_OBJ(args[0]));  // Flatten before allocating the result
+    ObjString *result = allocateString(length);
+    toUpperBytes(result->chars, stringChars(AS_OBJ(args[0])), length);
+    args[-1] = OBJ_VAL(result);
+    return true;
+}
+
+// split(string, separator) -> list of the pieces between separators. The
+// pieces share the characters of `string`.
+static bool splitNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (!checkStrings("split", args, 2)) { return false; }
+    usize const length = stringLength(AS_OBJ(args[0]));
+    usize const separatorLength = stringLength(AS_OBJ(args[1]));
+    if (separatorLength == 0) {
+        runtimeError("split() separator must not be empty.");
+        return false;
+    }
+
+    ObjList *list = newList();
+    args[-1] = OBJ_VAL(list);
+    const char *chars = stringChars(AS_OBJ(args[0]));
+    const char *separator = stringChars(AS_OBJ(args[1]));
+    usize start = 0;
+    while (true) {
+        const char *found = findBytes(chars + start, length - start, separator, separatorLength);
+        usize const end = found != NULL ? (usize)(found - chars) : length;
+        Value const piece = OBJ_VAL(sliceString(AS_OBJ(args[0]), start, end - start));
+        push(piece);  // Growing the list may collect
+        writeValueArray(&list->items, piece);
+        pop();
+        if (found == NULL) { break; }
+        start = end + separatorLength;
+    }
+    return true;
+}
+
+static bool checkList(const char *name, Value value) {
+    if (!IS_LIST(value)) {
+        runtimeError("%s() expects a list.", name);
+        return false;
+    }
+    return true;
+}
+
+// join(list, separator) -> the strings of `list` with `separator` between them
+static bool joinNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (!checkList("join", args[0]) || !checkStrings("join", args + 1, 1)) { return false; }
+    ValueArray const *items = &AS_LIST(args[0])->items;
+    usize const separatorLength = stringLength(AS_OBJ(args[1]));
+    usize length = 0;
+    for (usize i = 0; i < items->count; ++i) {
+        if (!IS_ANY_STRING(items->values[i])) {
+            runtimeError("join() expects a list of strings.");
+            return false;
+        }
+        stringChars(AS_OBJ(items->values[i]));  // Flatten before allocating the result
+        length += stringLength(AS_OBJ(items->values[i])) + (i != 0 ? separatorLength : 0U);
+    }
+    stringChars(AS_OBJ(args[1]));
+
+    ObjString *result = allocateString(length);
+    char *dest = result->chars;
+    for (usize i = 0; i < items->count; ++i) {
+        if (i != 0) {
+            memcpy(dest, stringChars(AS_OBJ(args[1])), separatorLength);
+            dest += separatorLength;
+        }
+        Obj *item = AS_OBJ(items->values[i]);
+        memcpy(dest, stringChars(item), stringLength(item));
+        dest += stringLength(item);
+    }
+    args[-1] = OBJ_VAL(result);
+    return true;
+}
+
+static bool pushNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (!checkList("push", args[0])) { return false; }
+    writeValueArray(&AS_LIST(args[0])->items, args[1]);
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+static bool popNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (!checkList("pop", args[0])) { return false; }
+    ValueArray *items = &AS_LIST(args[0])->items;
+    if (items->count == 0) {
+        runtimeError("pop() from an empty list.");
+        return false;
+    }
+    args[-1] = items->values[--items->count];
+    return true;
+}
+
+// insert(list, index, value) moves the elements from `index` on up by one
+static bool insertNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (!checkList("insert", args[0])) { return false; }
+    ValueArray *items = &AS_LIST(args[0])->items;
+    usize index;  // NOLINT
+    if (!toIndex(args[1], &index) || index > items->count) {
+        runtimeError("insert() index out of range.");
+        return false;
+    }
+    writeValueArray(items, args[2]);
+    memmove(items->values + index + 1, items->values + index, sizeof(Value) * (items->count - 1U - index));
+    items->values[index] = args[2];
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+static bool checkMap(const char *name, Value value) {
+    if (!IS_MAP(value)) {
+        runtimeError("%s() expects a map.", name);
+        return false;
+    }
+    return true;
+}
+
+// Keys or values of `map` as a list, in no particular order
+static bool collectEntries(Value *args, bool wantKeys) {
+    Map const *entries = &AS_MAP(args[0])->entries;
+    ObjList *list = newList();
+    args[-1] = OBJ_VAL(list);
+    for (usize i = 0; i < entries->capacity; ++i) {
+        MapEntry const *entry = &entries->entries[i];
+        if (IS_NIL(entry->key)) { continue; }
+        writeValueArray(&list->items, wantKeys ? entry->key : entry->value);
+    }
+    return true;
+}
+
+static bool keysNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (!checkMap("keys", args[0])) { return false; }
+    return collectEntries(args, true);
+}
+
+static bool valuesNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (!checkMap("values", args[0])) { return false; }
+    return collectEntries(args, false);
+}
+
+static bool hasNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (!checkMap("has", args[0])) { return false; }
+    Value value;
+    args[-1] = BOOL_VAL(mapGet(&AS_MAP(args[0])->entries, args[1], &value));
+    return true;
+}
+
+// remove(map, key) -> whether `key` was in the map
+static bool removeNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (!checkMap("remove", args[0])) { return false; }
+    args[-1] = BOOL_VAL(mapDelete(&AS_MAP(args[0])->entries, args[1]));
+    return true;
+}
+
+// f64Array(length) -> zero filled array
+// f64Array(list) -> array with the numbers of `list`
+static bool f64ArrayNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (IS_LIST(args[0])) {
+        ValueArray const *items = &AS_LIST(args[0])->items;
+        for (usize i = 0; i < items->count; ++i) {
+            if (!IS_NUMBER(items->values[i])) {
+                runtimeError("f64Array() expects a list of numbers.");
+                return false;
+            }
+        }
+        ObjF64Array *array = newF64Array(items->count);
+        for (usize i = 0; i < items->count; ++i) { array->values[i] = AS_NUMBER(items->values[i]); }
+        args[-1] = OBJ_VAL(array);
+        return true;
+    }
+    usize length;  // NOLINT
+    if (!toIndex(args[0], &length)) {
+        runtimeError("f64Array() expects a length or a list.");
+        return false;
+    }
+    args[-1] = OBJ_VAL(newF64Array(length));
+    return true;
+}
+
+// All of `args` must be arrays of the same length
+static bool checkF64Arrays(const char *name, Value const *args, i32 count) {
+    for (i32 i = 0; i < count; ++i) {
+        if (!IS_F64_ARRAY(args[i])) {
+            runtimeError("%s() expects f64 arrays.", name);
+            return false;
+        }
+        if (AS_F64_ARRAY(args[i])->length != AS_F64_ARRAY(args[0])->length) {
+            runtimeError("%s() expects arrays of the same length.", name);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool f64AddNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (!checkF64Arrays("f64Add", args, 2)) { return false; }
+    usize const length = AS_F64_ARRAY(args[0])->length;
+    ObjF64Array *result = newF64Array(length);
+    f64Kernels.add(result->values, AS_F64_ARRAY(args[0])->values, AS_F64_ARRAY(args[1])->values, length);
+    args[-1] = OBJ_VAL(result);
+    return true;
+}
+
+static bool f64MulNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (!checkF64Arrays("f64Mul", args, 2)) { return false; }
+    usize const length = AS_F64_ARRAY(args[0])->length;
+    ObjF64Array *result = newF64Array(length);
+    f64Kernels.mul(result->values, AS_F64_ARRAY(args[0])->values, AS_F64_ARRAY(args[1])->values, length);
+    args[-1] = OBJ_VAL(result);
+    return true;
+}
+
+// f64Fma(a, b, c) -> a * b + c element-wise
+static bool f64FmaNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (!checkF64Arrays("f64Fma", args, 3)) { return false; }
+    usize const length = AS_F64_ARRAY(args[0])->length;
+    ObjF64Array *result = newF64Array(length);
+    f64Kernels.fma(result->values, AS_F64_ARRAY(args[0])->values, AS_F64_ARRAY(args[1])->values,
+                   AS_F64_ARRAY(args[2])->values, length);
+    args[-1] = OBJ_VAL(result);
+    return true;
+}
+
+static bool f64ScaleNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (!checkF64Arrays("f64Scale", args, 1)) { return false; }
+    if (!IS_NUMBER(args[1])) {
+        runtimeError("f64Scale() expects a number factor.");
+        return false;
+    }
+    usize const length = AS_F64_ARRAY(args[0])->length;
+    ObjF64Array *result = newF64Array(length);
+    f64Kernels.scale(result->values, AS_F64_ARRAY(args[0])->values, AS_NUMBER(args[1]), length);
+    args[-1] = OBJ_VAL(result);
+    return true;
+}
+
+static bool f64SumNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (!checkF64Arrays("f64Sum", args, 1)) { return false; }
+    ObjF64Array const *array = AS_F64_ARRAY(args[0]);
+    args[-1] = NUMBER_VAL(f64Kernels.sum(array->values, array->length));
+    return true;
+}
+
+static bool f64DotNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (!checkF64Arrays("f64Dot", args, 2)) { return false; }
+    usize const length = AS_F64_ARRAY(args[0])->length;
+    args[-1] = NUMBER_VAL(f64Kernels.dot(AS_F64_ARRAY(args[0])->values, AS_F64_ARRAY(args[1])->values, length));
+    return true;
+}
+
+// nil for an empty array
+static bool f64MinNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (!checkF64Arrays("f64Min", args, 1)) { return false; }
+    ObjF64Array const *array = AS_F64_ARRAY(args[0]);
+    args[-1] = array->length == 0 ? NIL_VAL : NUMBER_VAL(f64Kernels.min(array->values, array->length));
+    return true;
+}
+
+static bool f64MaxNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (!checkF64Arrays("f64Max", args, 1)) { return false; }
+    ObjF64Array const *array = AS_F64_ARRAY(args[0]);
+    args[-1] = array->length == 0 ? NIL_VAL : NUMBER_VAL(f64Kernels.max(array->values, array->length));
+    return true;
+}
+
+static bool bytesNative(i32 argCount, Value *args) {
+    (void)argCount;
+    usize length;  // NOLINT
+    if (!toIndex(args[0], &length)) {
+        runtimeError("bytes() expects a length.");
+        return false;
+    }
+    args[-1] = OBJ_VAL(newBytes(length));
+    return true;
+}
+
+static bool checkBytes(const char *name, Value value) {
+    if (!IS_BYTES(value)) {
+        runtimeError("%s() expects bytes.", name);
+        return false;
+    }
+    return true;
+}
+
+// bytesSlice(bytes, start, end) -> view of the bytes in [start, end),
+// sharing their storage
+static bool bytesSliceNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (!checkBytes("bytesSlice", args[0])) { return false; }
+    ObjBytes *bytes = AS_BYTES(args[0]);
+    usize start;  // NOLINT
+    usize end;  // NOLINT
+    if (!toIndex(args[1], &start) || !toIndex(args[2], &end) || start > end || end > bytes->length) {
+        runtimeError("bytesSlice() range out of bounds.");
+        return false;
+    }
+    args[-1] = OBJ_VAL(newBytesView(bytes, start, end - start));
+    return true;
+}
+
+static bool bytesToStringNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (!checkBytes("bytesToString", args[0])) { return false; }
+    ObjBytes const *bytes = AS_BYTES(args[0]);
+    args[-1] = OBJ_VAL(newString((const char *)bytes->data, bytes->length));
+    return true;
+}
+
+static bool bytesFromStringNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (!checkStrings("bytesFromString", args, 1)) { return false; }
+    usize const length = stringLength(AS_OBJ(args[0]));
+    stringChars(AS_OBJ(args[0]));  // Flatten before allocating the result
+    ObjBytes *bytes = newBytes(length);
+    memcpy(bytes->data, stringChars(AS_OBJ(args[0])), length);
+    args[-1] = OBJ_VAL(bytes);
+    return true;
+}
+
+// Multi-byte values are little endian and need not be aligned
+static u64 readLittleEndian(const u8 *data, usize width) {
+    u64 value = 0;
+    for (usize i = width; i-- > 0;) { value = (value << 8U) | data[i]; }
+    return value;
+}
+
+static void writeLittleEndian(u8 *data, usize width, u64 value) {
+    for (usize i = 0; i < width; ++i) { data[i] = (u8)(value >> (8U * i)); }
+}
+
+// Where a `width` byte value at args[1] starts in the bytes at args[0]
+static u8 *bytesAt(const char *name, Value const *args, usize width) {
+    if (!checkBytes(name, args[0])) { return NULL; }
+    ObjBytes const *bytes = AS_BYTES(args[0]);
+    usize offset;  // NOLINT
+    if (!toIndex(args[1], &offset) || offset > bytes->length || bytes->length - offset < width) {
+        runtimeError("%s() offset out of bounds.", name);
+        return NULL;
+    }
+    return bytes->data + offset;
+}
+
+static bool getUnsigned(const char *name, Value *args, usize width) {
+    u8 const *data = bytesAt(name, args, width);
+    if (data == NULL) { return false; }
+    args[-1] = INT_VAL((i64)readLittleEndian(data, width));
+    return true;
+}
+
+static bool setUnsigned(const char *name, Value *args, usize width) {
+    u8 *data = bytesAt(name, args, width);
+    if (data == NULL) { return false; }
+    usize value;  // NOLINT
+    if (!toIndex(args[2], &value) || (u64)value > (UINT64_MAX >> (64U - 8U * width))) {
+        runtimeError("%s() value out of range.", name);
+        return false;
+    }
+    writeLittleEndian(data, width, value);
+    args[-1] = args[2];
+    return true;
+}
+
+static bool getU8Native(i32 argCount, Value *args) {
+    (void)argCount;
+    return getUnsigned("getU8", args, 1);
+}
+
+static bool getU16Native(i32 argCount, Value *args) {
+    (void)argCount;
+    return getUnsigned("getU16", args, 2);
+}
+
+static bool getU32Native(i32 argCount, Value *args) {
+    (void)argCount;
+    return getUnsigned("getU32", args, 4);
+}
+
+static bool setU8Native(i32 argCount, Value *args) {
+    (void)argCount;
+    return setUnsigned("setU8", args, 1);
+}
+
+static bool setU16Native(i32 argCount, Value *args) {
+    (void)argCount;
+    return setUnsigned("setU16", args, 2);
+}
+
+static bool setU32Native(i32 argCount, Value *args) {
+    (void)argCount;
+    return setUnsigned("setU32", args, 4);
+}
+
+static bool getF64Native(i32 argCount, Value *args) {
+    (void)argCount;
+    u8 const *data = bytesAt("getF64", args, sizeof(double));
+    if (data == NULL) { return false; }
+    u64 const bits = readLittleEndian(data, sizeof(double));
+    double value;  // NOLINT
+    memcpy(&value, &bits, sizeof(value));
+    // Arbitrary NaN payloads could read back as tagged values
+    args[-1] = NUMBER_VAL(isnan(value) ? (double)NAN : value);
+    return true;
+}
+
+static bool setF64Native(i32 argCount, Value *args) {
+    (void)argCount;
+    u8 *data = bytesAt("setF64", args, sizeof(double));
+    if (data == NULL) { return false; }
+    if (!IS_NUMBER(args[2])) {
+        runtimeError("setF64() expects a number.");
+        return false;
+    }
+    double const value = AS_NUMBER(args[2]);
+    u64 bits;  // NOLINT
+    memcpy(&bits, &value, sizeof(bits));
+    writeLittleEndian(data, sizeof(double), bits);
+    args[-1] = args[2];
+    return true;
+}
+
+#ifdef HAS_POSIX_IO
+
+static bool toFd(const char *name, Value value, int *fd) {
+    usize number;  // NOLINT
+    if (!toIndex(value, &number) || number > INT_MAX) {
+        runtimeError("%s() expects a file descriptor.", name);
+        return false;
+    }
+    *fd = (int)number;
+    return true;
+}
+
+// fdOpen(path, mode) -> file descriptor, or nil if the file can't be opened.
+// mode is "r", "w" (create or truncate), "a" (create or append) or "rw".
+static bool fdOpenNative(i32 argCount, Value *args) {
+    (void)argCount;
+    if (!checkStrings("fdOpen", args, 2)) { return false; }
+    const char *mode = flattenString(AS_OBJ(args[1]))->chars;
+    int flags;  // NOLINT
+    if (strcmp(mode, "r") == 0) {
+        flags = O_RDONLY;
+    } else if (strcmp(mode, "w") == 0) {
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    } else if (strcmp(mode, "a") == 0) {
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    } else if (strcmp(mode, "rw") == 0) {
+        flags = O_RDWR | O_CREAT;
+    } else {
+        runtimeError("fdOpen() mode must be \"r\", \"w\", \"a\" or \"rw\".");
+        return false;
+    }
+    int const fd = open(flattenString(AS_OBJ(args[0]))->chars, flags | O_CLOEXEC, 0666);  // NOLINT
+    args[-1] = fd < 0 ? NIL_VAL : INT_VAL(fd);
+    return true;
+}
+
+// fdRead(fd, bytes) -> how many bytes were read into `bytes`, 0 at the end
+static bool fdReadNative(i32 argCount, Value *args) {
+    (void)argCount;
+    int fd;  // NOLINT
+    if (!toFd("fdRead", args[0], &fd) || !checkBytes("fdRead", args[1])) { return false; }
+    ObjBytes *bytes = AS_BYTES(args[1]);
+    ssize_t count;  // NOLINT
+    do {
+        count = read(fd, bytes->data, bytes->length);
+    } while (count < 0 && errno == EINTR);
+    if (count < 0) {
+        runtimeError("fdRead() failed: %s.", strerror(errno));
+        return false;
+    }
+    args[-1] = INT_VAL((i64)count);
+    return true;
+}
+
+// fdWrite(fd, bytes) writes all of `bytes`
+static bool fdWriteNative(i32 argCount, Value *args) {
+    (void)argCount;
+    int fd;  // NOLINT
+    if (!toFd("fdWrite", args[0], &fd) || !checkBytes("fdWrite", args[1])) { return false; }
+    ObjBytes const *bytes = AS_BYTES(args[1]);
+    usize written = 0;
+    while (written < bytes->length) {
+        ssize_t const count = write(fd, bytes->data + written, bytes->length - written);
+        if (count < 0 && errno == EINTR) { continue; }
+        if (count < 0) {
+            runtimeError("fdWrite() failed: %s.", strerror(errno));
+            return false;
+        }
+        written += (usize)count;
+    }
+    args[-1] = INT_VAL((i64)written);
+    return true;
+}
+
+static bool fdCloseNative(i32 argCount, Value *args) {
+    (void)argCount;
+    int fd;  // NOLINT
+    if (!toFd("fdClose", args[0], &fd)) { return false; }
+    if (close(fd) < 0) {
+        runtimeError("fdClose() failed: %s.", strerror(errno));
+        return false;
+    }
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+#endif
+
+void defineNatives(void) {
+    selectStringKernels();
+    selectF64Kernels();
+
+    defineNative("clock", 0, clockNative);
+    defineNative("substring", 3, substringNative);
+    defineNative("len", 1, lenNative);
+    defineNative("range", -1, rangeNative);
+    defineNative("indexOf", -1, indexOfNative);
+    defineNative("startsWith", 2, startsWithNative);
+    defineNative("replace", 3, replaceNative);
+    defineNative("trim", 1, trimNative);
+    defineNative("toUpper", 1, toUpperNative);
+    defineNative("split", 2, splitNative);
+    defineNative("join", 2, joinNative);
+    defineNative("push", 2, pushNative);
+    defineNative("pop", 1, popNative);
+    defineNative("insert", 3, insertNative);
+    defineNative("keys", 1, keysNative);
+    defineNative("values", 1, valuesNative);
+    defineNative("has", 2, hasNative);
+    defineNative("remove", 2, removeNative);
+    defineNative("f64Array", 1, f64ArrayNative);
+    defineNative("f64Add", 2, f64AddNative);
+    defineNative("f64Mul", 2, f64MulNative);
+    defineNative("f64Fma", 3, f64FmaNative);
+    defineNative("f64Scale", 2, f64ScaleNative);
+    defineNative("f64Sum", 1, f64SumNative);
+    defineNative("f64Dot", 2, f64DotNative);
+    defineNative("f64Min", 1, f64MinNative);
+    defineNative("f64Max", 1, f64MaxNative);
+    defineNative("bytes", 1, bytesNative);
+    defineNative("bytesSlice", 3, bytesSliceNative);
+    defineNative("bytesToString", 1, bytesToStringNative);
+    defineNative("bytesFromString", 1, bytesFromStringNative);
+    defineNative("getU8", 2, getU8Native);
+    defineNative("getU16", 2, getU16Native);
+    defineNative("getU32", 2, getU32Native);
+    defineNative("getF64", 2, getF64Native);
+    defineNative("setU8", 3, setU8Native);
+    defineNative("setU16", 3, setU16Native);
+    defineNative("setU32", 3, setU32Native);
+    defineNative("setF64", 3, setF64Native);
+#ifdef HAS_POSIX_IO
+    defineNative("fdOpen", 2, fdOpenNative);
+    defineNative("fdRead", 2, fdReadNative);
+    defineNative("fdWrite", 2, fdWriteNative);
+    defineNative("fdClose", 1, fdCloseNative);
+#endif
+}
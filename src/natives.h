@@ -0,0 +1,6 @@
+#ifndef CLOX_NATIVES_H
+#define CLOX_NATIVES_H
+
+void defineNatives(void);
+
+#endif
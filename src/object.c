@@ -1,15 +1,26 @@
 #include "object.h"
 #include "chunk.h"
+#include "hash.h"
 #include "memory.h"
 #include "string.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
 #include <stdio.h>
+#include <stdlib.h>
 
 #define ALLOCATE_OBJ(type, objectType) \
     (type *)allocateObject(sizeof(type), objectType)
 
+// Shorter concatenations are copied into a flat string right away
+#define ROPE_MIN_LENGTH 64U
+
+// Longest private leaf built when appending to a rope
+#define ROPE_LEAF_LENGTH 256U
+
+// Shorter slices are copied rather than keeping their parent alive
+#define SLICE_MIN_LENGTH 32U
+
 static Obj *allocateObject(usize size, ObjType type) {
     Obj *object = (Obj *)reallocate(NULL, 0, size);
     object->type = type;
@@ -22,26 +33,34 @@ static Obj *allocateObject(usize size, ObjType type) {
 ObjClass *newClass(ObjString *name) {
     ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     klass->name = name;
+    klass->isSealed = false;
+    klass->initializer = NULL;
+    klass->fieldCountHint = 0;
     initTable(&klass->methods);
+    initSealedTable(&klass->sealedMethods);
     return klass;
 }
 
+// Sizes the fields for as many as an instance of `klass` has had so far.
+// The table is allocated first so a collection cannot sweep the instance.
 ObjInstance *newInstance(ObjClass *klass) {
+    Table fields;  // NOLINT
+    initTableWithCapacity(&fields, klass->fieldCountHint);
     ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
     instance->klass = klass;
-    initTable(&instance->fields);
+    instance->fields = fields;
     return instance;
 }
 
 ObjClosure *newClosure(ObjFunction *function) {
-    ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, function->upvalueCount);
-    for (usize i = 0; i < function->upvalueCount; ++i) {
-        upvalues[i] = NULL;
-    }
-    ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    usize const upvalueCount = function->upvalueCount;
+    ObjClosure *closure = (ObjClosure *)allocateObject(
+        sizeof(ObjClosure) + sizeof(Value) * upvalueCount, OBJ_CLOSURE);
     closure->function = function;
-    closure->upvalues = upvalues;
-    closure->upvalueCount = function->upvalueCount;
+    closure->upvalueCount = upvalueCount;
+    for (usize i = 0; i < upvalueCount; ++i) {
+        closure->upvalues[i] = NIL_VAL;
+    }
     return closure;
 }
 
@@ -50,61 +69,259 @@ ObjFunction *newFunction(void) {
     function->arity = 0;
     function->name = NULL;
     function->upvalueCount = 0;
+    function->slotCount = 0;
+    function->closure = NULL;
     initChunk(&function->chunk);
     return function;
 }
 
-ObjNative *newNative(NativeFn function) {
+ObjNative *newNative(NativeFn function, i32 arity) {
     ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function = function;
+    native->arity = arity;
     return native;
 }
 
-static ObjString *allocateString(char *chars, usize length, u32 hash) {
-    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+ObjString *allocateString(usize length) {
+    ObjString *string = (ObjString *)allocateObject(sizeof(ObjString) + length + 1U, OBJ_STRING);
     string->length = length;
-    string->chars = chars;
-    string->hash = hash;
+    string->hash = 0;
+    string->isHashed = false;
+    string->isInterned = false;
+    string->chars[length] = '\0';
+    return string;
+}
+
+static ObjString *addInterned(ObjString *string) {
+    string->isInterned = true;
     push(OBJ_VAL(string));
+    // Gives back what tableRemoveWhite freed in the last collection
+    tableCompact(&vm.strings);
     tableSet(&vm.strings, string, NIL_VAL);
     pop();
     return string;
 }
 
-static u32 hashString(const char *key, usize length) {
-    u64 hash = 2166136261U;  // NOLINT
-    for (usize i = 0; i < length; ++i) {
-        hash ^= (u64)key[i];
-        hash *= 16777619U;  // NOLINT
+u32 stringHash(ObjString *string) {
+    if (!string->isHashed) {
+        string->hash = hashString(string->chars, string->length);
+        string->isHashed = true;
     }
-    return (u32)hash;
+    return string->hash;
 }
 
-ObjString *takeString(char *chars, usize length) {
-    u32 const hash = hashString(chars, length);
+ObjString *findInterned(ObjString *string) {
+    if (string->isInterned) { return string; }
+    return tableFindString(&vm.strings, string->chars, string->length, stringHash(string));
+}
 
-    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
-    if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1U);
-        return interned;
-    }
-    return allocateString(chars, length, hash);
+ObjString *internString(ObjString *string) {
+    ObjString *interned = findInterned(string);
+    return interned != NULL ? interned : addInterned(string);
 }
 
 ObjString *copyString(const char *chars, usize length) {
-    char *heapChars = ALLOCATE(char, length + 1U);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
     u32 const hash = hashString(chars, length);
     ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
     if (interned != NULL) { return interned; }
-    return allocateString(heapChars, length, hash);
+
+    ObjString *string = allocateString(length);
+    memcpy(string->chars, chars, length);
+    string->hash = hash;
+    string->isHashed = true;
+    return addInterned(string);
+}
+
+ObjString *newString(const char *chars, usize length) {
+    ObjString *string = allocateString(length);
+    memcpy(string->chars, chars, length);
+    return string;
+}
+
+static bool isStringObject(Obj const *object) {
+    return object->type == OBJ_STRING || object->type == OBJ_ROPE || object->type == OBJ_SLICE;
+}
+
+usize stringLength(Obj const *string) {
+    switch (string->type) {
+    case OBJ_ROPE: return ((ObjRope const *)string)->length;
+    case OBJ_SLICE: return ((ObjSlice const *)string)->length;
+    default: return ((ObjString const *)string)->length;
+    }
+}
+
+static ObjString *flattenRope(ObjRope *rope);
+
+// Characters of any string object; slices are not NUL-terminated. Ropes are
+// flattened, so the argument must be reachable by the GC.
+const char *stringChars(Obj *string) {
+    switch (string->type) {
+    case OBJ_ROPE: return flattenRope((ObjRope *)string)->chars;
+    case OBJ_SLICE: {
+        ObjSlice const *slice = (ObjSlice const *)string;
+        return slice->parent->chars + slice->start;
+    }
+    default: return ((ObjString *)string)->chars;
+    }
+}
+
+// Neither operand can be an unflattened rope
+static ObjString *concatenateFlat(Obj *a, Obj *b) {
+    usize const aLength = stringLength(a);
+    usize const bLength = stringLength(b);
+    ObjString *string = allocateString(aLength + bLength);
+    memcpy(string->chars, stringChars(a), aLength);
+    memcpy(string->chars + aLength, stringChars(b), bLength);
+    return string;
+}
+
+static ObjRope *newRope(Obj *left, Obj *right, usize length) {
+    ObjRope *rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->length = length;
+    rope->left = left;
+    rope->right = right;
+    rope->flat = NULL;
+    return rope;
+}
+
+static Obj *unwrapRope(Obj *string) {
+    if (string->type == OBJ_ROPE && ((ObjRope *)string)->flat != NULL) {
+        return (Obj *)((ObjRope *)string)->flat;
+    }
+    return string;
+}
+
+// Both operands must be reachable by the GC (e.g. still on the VM stack).
+Obj *concatenateStrings(Obj *a, Obj *b) {
+    a = unwrapRope(a);
+    b = unwrapRope(b);
+    usize const length = stringLength(a) + stringLength(b);
+    if (length < ROPE_MIN_LENGTH) {
+        return (Obj *)concatenateFlat(a, b);
+    }
+
+    // Appending short pieces one at a time would otherwise produce one node
+    // per piece: merge them into a new leaf instead.
+    if (a->type == OBJ_ROPE && b->type != OBJ_ROPE) {
+        ObjRope const *rope = (ObjRope const *)a;
+        if (rope->right->type != OBJ_ROPE
+            && stringLength(rope->right) + stringLength(b) <= ROPE_LEAF_LENGTH) {
+            ObjString *leaf = concatenateFlat(rope->right, b);
+            push(OBJ_VAL(leaf));
+            ObjRope *merged = newRope(rope->left, (Obj *)leaf, length);
+            pop();
+            return (Obj *)merged;
+        }
+    }
+    return (Obj *)newRope(a, b, length);
+}
+
+static void pushPending(Obj ***stack, usize *count, usize *capacity, Obj *node) {
+    if (*capacity < *count + 1U) {
+        *capacity = GROW_CAPACITY(*capacity);
+        Obj **grown = (Obj **)realloc(*stack, sizeof(Obj *) * *capacity);
+        if (grown == NULL) { exit(1); }  // NOLINT
+        *stack = grown;
+    }
+    (*stack)[(*count)++] = node;
+}
+
+static ObjString *flattenRope(ObjRope *rope) {
+    if (rope->flat != NULL) { return rope->flat; }
+
+    ObjString *string = allocateString(rope->length);
+    char *end = string->chars + rope->length;
+
+    // Fill right to left, deferring the left children. Ropes built by
+    // appending keep this stack at a single entry.
+    Obj **pending = NULL;
+    usize pendingCount = 0;
+    usize pendingCapacity = 0;
+    Obj *node = (Obj *)rope;
+    while (true) {
+        node = unwrapRope(node);
+        if (node->type == OBJ_ROPE) {
+            pushPending(&pending, &pendingCount, &pendingCapacity, ((ObjRope *)node)->left);
+            node = ((ObjRope *)node)->right;
+            continue;
+        }
+        usize const length = stringLength(node);
+        end -= length;
+        memcpy(end, stringChars(node), length);
+        if (pendingCount == 0) { break; }
+        node = pending[--pendingCount];
+    }
+    free((void *)pending);
+
+    rope->flat = string;
+    rope->left = NULL;
+    rope->right = NULL;
+    return rope->flat;
+}
+
+static ObjString *flattenSlice(ObjSlice *slice) {
+    if (slice->start == 0 && slice->length == slice->parent->length) { return slice->parent; }
+    ObjString *flat = newString(slice->parent->chars + slice->start, slice->length);
+    slice->parent = flat;
+    slice->start = 0;
+    return flat;
+}
+
+// The argument must be reachable by the GC: flattening may allocate.
+ObjString *flattenString(Obj *string) {
+    switch (string->type) {
+    case OBJ_ROPE: return flattenRope((ObjRope *)string);
+    case OBJ_SLICE: return flattenSlice((ObjSlice *)string);
+    default: return (ObjString *)string;
+    }
+}
+
+// The range must lie within the string, which must be reachable by the GC.
+Obj *sliceString(Obj *string, usize start, usize length) {
+    if (string->type == OBJ_ROPE) { string = (Obj *)flattenRope((ObjRope *)string); }
+    if (string->type == OBJ_SLICE) {
+        ObjSlice const *slice = (ObjSlice const *)string;
+        start += slice->start;
+        string = (Obj *)slice->parent;
+    }
+    ObjString *parent = (ObjString *)string;
+    if (start == 0 && length == parent->length) { return (Obj *)parent; }
+    if (length < SLICE_MIN_LENGTH) { return (Obj *)newString(parent->chars + start, length); }
+
+    ObjSlice *slice = ALLOCATE_OBJ(ObjSlice, OBJ_SLICE);
+    slice->parent = parent;
+    slice->start = start;
+    slice->length = length;
+    return (Obj *)slice;
+}
+
+static bool stringsEqual(ObjString const *a, ObjString const *b) {
+    if (a == b) { return true; }
+    if (a->isInterned && b->isInterned) { return false; }
+    if (a->length != b->length) { return false; }
+    if (a->isHashed && b->isHashed && a->hash != b->hash) { return false; }
+    return memcmp(a->chars, b->chars, a->length) == 0;
+}
+
+// Both objects must be reachable by the GC: comparing ropes flattens them.
+bool objectsEqual(Obj *a, Obj *b) {
+    if (a == b) { return true; }
+    if (!isStringObject(a) || !isStringObject(b)) { return false; }
+    usize const length = stringLength(a);
+    if (length != stringLength(b)) { return false; }
+    if (a->type == OBJ_ROPE) { a = (Obj *)flattenRope((ObjRope *)a); }
+    if (b->type == OBJ_ROPE) { b = (Obj *)flattenRope((ObjRope *)b); }
+    if (a->type == OBJ_STRING && b->type == OBJ_STRING) {
+        return stringsEqual((ObjString const *)a, (ObjString const *)b);
+    }
+    return memcmp(stringChars(a), stringChars(b), length) == 0;
 }
 
 ObjUpvalue *newUpvalue(Value *slot) {
     ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
     upvalue->location = slot;
     upvalue->next = NULL;
+    upvalue->prev = NULL;
     upvalue->closed = NIL_VAL;
     return upvalue;
 }
@@ -116,6 +333,35 @@ ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method) {
     return bound;
 }
 
+ObjList *newList(void) {
+    ObjList *list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+    initValueArray(&list->items);
+    return list;
+}
+
+ObjMap *newMap(void) {
+    ObjMap *map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
+    initMap(&map->entries);
+    return map;
+}
+
+// Zero filled
+ObjF64Array *newF64Array(usize length) {
+    ObjF64Array *array = (ObjF64Array *)allocateObject(
+        sizeof(ObjF64Array) + sizeof(double) * length, OBJ_F64_ARRAY);
+    array->length = length;
+    for (usize i = 0; i < length; ++i) { array->values[i] = 0.0; }
+    return array;
+}
+
+ObjRange *newRange(i64 start, i64 end, i64 step) {
+    ObjRange *range = ALLOCATE_OBJ(ObjRange, OBJ_RANGE);
+    range->start = start;
+    range->end = end;
+    range->step = step;
+    return range;
+}
+
 static void printFunction(ObjFunction *function) {
     if (function->name == NULL) {
         printf("<script>");
@@ -124,6 +370,59 @@ static void printFunction(ObjFunction *function) {
     printf("<fn %s>", function->name->chars);
 }
 
+static void printList(ObjList const *list) {
+    printf("[");
+    for (usize i = 0; i < list->items.count; ++i) {
+        if (i != 0) { printf(", "); }
+        printValue(list->items.values[i]);
+    }
+    printf("]");
+}
+
+static void printMap(ObjMap const *map) {
+    printf("{");
+    bool first = true;
+    for (usize i = 0; i < map->entries.capacity; ++i) {
+        MapEntry const *entry = &map->entries.entries[i];
+        if (IS_NIL(entry->key)) { continue; }
+        if (!first) { printf(", "); }
+        first = false;
+        printValue(entry->key);
+        printf(": ");
+        printValue(entry->value);
+    }
+    printf("}");
+}
+
+static void printF64Array(ObjF64Array const *array) {
+    printf("f64[");
+    for (usize i = 0; i < array->length; ++i) {
+        if (i != 0) { printf(", "); }
+        printf("%g", array->values[i]);
+    }
+    printf("]");
+}
+
+// Zero filled. The storage is allocated first so a collection cannot sweep
+// the object before it owns it.
+ObjBytes *newBytes(usize length) {
+    u8 *data = (u8 *)allocateBuffer(length);
+    ObjBytes *bytes = ALLOCATE_OBJ(ObjBytes, OBJ_BYTES);
+    bytes->owner = NULL;
+    bytes->data = data;
+    bytes->length = length;
+    return bytes;
+}
+
+// The range must lie within `bytes`, which must be reachable by the GC
+ObjBytes *newBytesView(ObjBytes *bytes, usize start, usize length) {
+    ObjBytes *view = ALLOCATE_OBJ(ObjBytes, OBJ_BYTES);
+    view->owner = bytes->owner != NULL ? bytes->owner : bytes;
+    view->data = bytes->data + start;
+    view->length = length;
+    return view;
+}
+
 void printObject(Value value) {
     switch (OBJ_TYPE(value)) {
     case OBJ_STRING:
@@ -150,5 +449,30 @@ void printObject(Value value) {
     case OBJ_BOUND_METHOD:
         printFunction(AS_BOUND_METHOD(value)->method->function);
         break;
+    case OBJ_ROPE:
+        printf("%s", flattenRope(AS_ROPE(value))->chars);
+        break;
+    case OBJ_SLICE: {
+        ObjSlice const *slice = AS_SLICE(value);
+        printf("%.*s", (i32)slice->length, slice->parent->chars + slice->start);
+        break;
+    }
+    case OBJ_LIST:
+        printList(AS_LIST(value));
+        break;
+    case OBJ_MAP:
+        printMap(AS_MAP(value));
+        break;
+    case OBJ_F64_ARRAY:
+        printF64Array(AS_F64_ARRAY(value));
+        break;
+    case OBJ_BYTES:
+        printf("<bytes %lu>", AS_BYTES(value)->length);
+        break;
+    case OBJ_RANGE: {
+        ObjRange const *range = AS_RANGE(value);
+        printf("range(%g, %g, %g)", (double)range->start, (double)range->end, (double)range->step);
+        break;
+    }
     }
 }
@@ -3,6 +3,7 @@
 
 #include "chunk.h"
 #include "common.h"
+#include "map.h"
 #include "table.h"
 #include "value.h"
 
@@ -18,18 +19,42 @@
 
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
+
+#define IS_SLICE(value) isObjType(value, OBJ_SLICE)
+
+#define IS_ANY_STRING(value) (IS_STRING(value) || IS_ROPE(value) || IS_SLICE(value))
+
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
 
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
 
+#define IS_LIST(value) isObjType(value, OBJ_LIST)
+
+#define IS_MAP(value) isObjType(value, OBJ_MAP)
+
+#define IS_F64_ARRAY(value) isObjType(value, OBJ_F64_ARRAY)
+
+#define IS_BYTES(value) isObjType(value, OBJ_BYTES)
+
+#define IS_RANGE(value) isObjType(value, OBJ_RANGE)
+
 #define AS_CLASS(value) ((ObjClass *)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance *)AS_OBJ(value))
 #define AS_CLOSURE(value) ((ObjClosure *)AS_OBJ(value))
 #define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
-#define AS_NATIVE(value) (((ObjNative *)AS_OBJ(value))->function)
+#define AS_ROPE(value) ((ObjRope *)AS_OBJ(value))
+#define AS_SLICE(value) ((ObjSlice *)AS_OBJ(value))
+#define AS_NATIVE(value) ((ObjNative *)AS_OBJ(value))
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
+#define AS_UPVALUE(value) ((ObjUpvalue *)AS_OBJ(value))
+#define AS_LIST(value) ((ObjList *)AS_OBJ(value))
+#define AS_MAP(value) ((ObjMap *)AS_OBJ(value))
+#define AS_F64_ARRAY(value) ((ObjF64Array *)AS_OBJ(value))
+#define AS_BYTES(value) ((ObjBytes *)AS_OBJ(value))
+#define AS_RANGE(value) ((ObjRange *)AS_OBJ(value))
 
 
 typedef enum {
@@ -41,6 +66,13 @@ typedef enum {
     OBJ_CLASS,
     OBJ_INSTANCE,
     OBJ_BOUND_METHOD,
+    OBJ_ROPE,
+    OBJ_SLICE,
+    OBJ_LIST,
+    OBJ_MAP,
+    OBJ_F64_ARRAY,
+    OBJ_BYTES,
+    OBJ_RANGE,
 } ObjType;
 
 struct Obj {
@@ -49,46 +81,87 @@ struct Obj {
     struct Obj *next;
 };
 
+typedef struct ObjClosure ObjClosure;
+
 typedef struct {
     Obj obj;
     usize arity;
     usize upvalueCount;
+    usize slotCount;  // Most locals in scope at once, the function included
     Chunk chunk;
     ObjString *name;
+    ObjClosure *closure;  // Shared closure for functions without upvalues
 } ObjFunction;
 
-typedef Value (*NativeFn)(i32 argCount, Value *args);
+// Natives store their result in args[-1], the callee slot. On failure they
+// report a runtime error and return false.
+typedef bool (*NativeFn)(i32 argCount, Value *args);
 
 typedef struct {
     Obj obj;
     NativeFn function;
+    i32 arity;  // -1 for variadic natives
 } ObjNative;
 
+// Strings created by the compiler are interned up front. Strings built at
+// run time are neither hashed nor interned until a table needs them.
 struct ObjString {
     Obj obj;
     usize length;
-    char *chars;
     u32 hash;
+    bool isHashed;
+    bool isInterned;
+    char chars[];
 };
 
+// Result of a long concatenation. The characters are only gathered (and
+// hashed) the first time the string is compared or printed; after that the
+// children are dropped and the rope forwards to `flat`.
+typedef struct {
+    Obj obj;
+    usize length;
+    Obj *left;
+    Obj *right;
+    ObjString *flat;
+} ObjRope;
+
+// View over characters of a flat string. Once it has to be flattened the
+// view switches to its own copy, which lets the parent be collected.
+typedef struct {
+    Obj obj;
+    ObjString *parent;
+    usize start;
+    usize length;
+} ObjSlice;
+
 typedef struct ObjUpvalue {
     Obj obj;
     Value *location;
     Value closed;
     struct ObjUpvalue *next;
+    struct ObjUpvalue *prev;
 } ObjUpvalue;
 
-typedef struct {
+// Captured variables are either copied into the closure directly or, when
+// they may be reassigned, stored as OBJ_VAL of a shared ObjUpvalue.
+struct ObjClosure {
     Obj obj;
     ObjFunction *function;
-    ObjUpvalue **upvalues;
     usize upvalueCount;
-} ObjClosure;
+    Value upvalues[];
+};
 
+// OP_METHOD fills `methods` while the class body runs. OP_END_CLASS then
+// seals them into `sealedMethods` and frees the table, unless no perfect
+// layout was found, and caches `init`.
 typedef struct {
     Obj obj;
     ObjString *name;
+    ObjClosure *initializer;
+    usize fieldCountHint;  // Most fields any instance has had
+    bool isSealed;
     Table methods;
+    SealedTable sealedMethods;
 } ObjClass;
 
 typedef struct {
@@ -103,6 +176,39 @@ typedef struct {
     ObjClosure *method;
 } ObjBoundMethod;
 
+typedef struct {
+    Obj obj;
+    ValueArray items;
+} ObjList;
+
+typedef struct {
+    Obj obj;
+    Map entries;
+} ObjMap;
+
+// Fixed length, unboxed doubles
+typedef struct {
+    Obj obj;
+    usize length;
+    double values[];
+} ObjF64Array;
+
+// A fixed size byte buffer, or a view into the buffer of `owner`
+typedef struct ObjBytes {
+    Obj obj;
+    struct ObjBytes *owner;  // NULL for a buffer
+    u8 *data;
+    usize length;
+} ObjBytes;
+
+// Ints from `start` up to, but excluding, `end`. Never materialised.
+typedef struct {
+    Obj obj;
+    i64 start;
+    i64 end;
+    i64 step;
+} ObjRange;
+
 ObjClass *newClass(ObjString *name);
 
 ObjInstance *newInstance(ObjClass *klass);
@@ -111,16 +217,48 @@ ObjClosure *newClosure(ObjFunction *function);
 
 ObjFunction *newFunction(void);
 
-ObjNative *newNative(NativeFn function);
-
-ObjString *takeString(char *chars, usize length);
+ObjNative *newNative(NativeFn function, i32 arity);
 
 ObjString *copyString(const char *chars, usize length);
 
+ObjString *newString(const char *chars, usize length);
+
+ObjString *allocateString(usize length);
+
+u32 stringHash(ObjString *string);
+
+ObjString *findInterned(ObjString *string);
+
+ObjString *internString(ObjString *string);
+
+Obj *concatenateStrings(Obj *a, Obj *b);
+
+Obj *sliceString(Obj *string, usize start, usize length);
+
+ObjString *flattenString(Obj *string);
+
+usize stringLength(Obj const *string);
+
+const char *stringChars(Obj *string);
+
+bool objectsEqual(Obj *a, Obj *b);
+
 ObjUpvalue *newUpvalue(Value *slot);
 
 ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method);
 
+ObjList *newList(void);
+
+ObjMap *newMap(void);
+
+ObjF64Array *newF64Array(usize length);
+
+ObjBytes *newBytes(usize length);
+
+ObjBytes *newBytesView(ObjBytes *bytes, usize start, usize length);
+
+ObjRange *newRange(i64 start, i64 end, i64 step);
+
 void printObject(Value value);
 
 static inline bool isObjType(Value value, ObjType type) {
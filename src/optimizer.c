@@ -0,0 +1,1248 @@
+#include "optimizer.h"
+
+#include "chunk.h"
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+#include <stdint.h>
+#include <string.h>
+#ifdef DEBUG_PRINT_CODE
+#include "debug.h"
+#endif
+
+// Rounds of the cleanup passes, and of loop-invariant code motion, before
+// the optimizer settles for what it has
+#define MAX_ROUNDS 32
+
+// Functions this short, not counting OP_RETURN, are inlined at call sites
+#define INLINE_MAX_INSTRUCTIONS 16
+
+#define NOT_REACHED SIZE_MAX
+
+// One decoded instruction. Jumps name the instruction they land on rather
+// than a byte offset, so instructions can be removed or changed in place and
+// the offsets worked out again when the function is lowered to bytecode.
+typedef struct {
+    u8 op;
+    u8 operand;  // Slot, constant or count; the first operand byte
+    u8 argCount;  // Of OP_INVOKE, OP_SUPER_INVOKE and OP_GUARD_CALLEE
+    u8 popsBefore;  // Added on the exits of a loop that got new slots
+    u8 popsAfter;
+    bool isLeader;
+    bool isRemoved;
+    bool shiftSlots;  // Inside a loop that got new slots
+    i32 depth;  // Stack slots in use before the instruction runs
+    usize length;  // In bytes
+    usize offset;  // In the chunk being optimized, if it came from there
+    usize line;
+    usize target;  // Instruction a jump lands on
+    usize block;
+    usize inlined;  // 1 + its index in Optimizer.inlined, 0 if not inlined
+} Instruction;
+
+typedef struct {
+    usize start;
+    usize end;
+    usize successors[2];
+    usize successorCount;
+    usize predecessorStart;
+    usize predecessorCount;
+    usize idom;
+    usize order;  // Position in reverse postorder, NOT_REACHED if unreachable
+} Block;
+
+typedef struct {
+    ObjFunction *function;
+    bool isScript;
+    Instruction *code;
+    usize count;
+    Block *blocks;
+    usize blockCount;
+    usize *predecessors;
+    usize predecessorCount;
+    usize *reversePostorder;
+    usize reachableCount;
+    bool hasDepths;
+    i32 maxDepth;
+    // Globals loaded once before the loop that starts at `header`. The loop
+    // keeps them in slots shiftFrom and up, and its own locals move up.
+    usize header;
+    usize hoistedCount;
+    u8 hoisted[UINT8_COUNT];
+    u8 shiftFrom;
+    InlinedCode *inlined;  // Offsets are only meaningful in the chunk
+    usize inlinedCount;
+    usize inlinedCapacity;
+} Optimizer;
+
+// A function small enough to inline, decoded once
+typedef struct {
+    ObjString *name;  // Of the global the script defines it as
+    ObjFunction *function;
+    Instruction *body;  // Without the final OP_RETURN
+    usize bodyCount;
+    i32 returnDepth;  // Callee-relative stack depth at OP_RETURN
+    i32 maxDepth;
+} Inlinee;
+
+typedef struct {
+    Inlinee *inlinees;
+    usize count;
+    usize capacity;
+} Inlinees;
+
+static ObjString *constantString(Optimizer const *optimizer, u8 constant) {
+    return AS_STRING(optimizer->function->chunk.constants.values[constant]);
+}
+
+static bool isJump(u8 op) {
+    return op == OP_JUMP || op == OP_LOOP || op == OP_JUMP_IF_FALSE || op == OP_FOR_ITER
+           || op == OP_GUARD_CALLEE;
+}
+
+static bool endsBlock(u8 op) {
+    return isJump(op) || op == OP_RETURN;
+}
+
+// Net stack effect when the instruction falls through to the next one
+static i32 stackEffect(Instruction const *instruction) {
+    switch (instruction->op) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_GET_FLAT_UPVALUE:
+    case OP_CLOSURE:
+    case OP_CLASS:
+    case OP_FOR_ITER:
+        return 1;
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_PRINT:
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_CLOSE_UPVALUE:
+    case OP_SET_PROPERTY:
+    case OP_GET_INDEX:
+    case OP_METHOD:
+    case OP_END_CLASS:
+    case OP_INHERIT:
+    case OP_GET_SUPER:
+        return -1;
+    case OP_SET_INDEX:
+        return -2;
+    case OP_CALL:
+        return -(i32)instruction->operand;
+    case OP_INVOKE:
+        return -(i32)instruction->argCount;
+    case OP_SUPER_INVOKE:
+        return -(i32)instruction->argCount - 1;
+    case OP_LIST:
+        return 1 - (i32)instruction->operand;
+    case OP_MAP:
+        return 1 - 2 * (i32)instruction->operand;
+    case OP_INLINE_RETURN:
+        return -(i32)instruction->operand;
+    default:
+        return 0;
+    }
+}
+
+static void initOptimizer(Optimizer *optimizer, ObjFunction *function, bool isScript) {
+    optimizer->function = function;
+    optimizer->isScript = isScript;
+    optimizer->code = NULL;
+    optimizer->count = 0;
+    optimizer->blocks = NULL;
+    optimizer->blockCount = 0;
+    optimizer->predecessors = NULL;
+    optimizer->reversePostorder = NULL;
+    optimizer->inlined = NULL;
+    optimizer->inlinedCount = 0;
+    optimizer->inlinedCapacity = 0;
+}
+
+// Frees the control-flow analysis of the instructions, not the instructions
+static void freeBlocks(Optimizer *optimizer) {
+    if (optimizer->blocks == NULL) { return; }
+    FREE_ARRAY(Block, optimizer->blocks, optimizer->count);
+    FREE_ARRAY(usize, optimizer->predecessors, 2U * optimizer->count);
+    FREE_ARRAY(usize, optimizer->reversePostorder, optimizer->count);
+    optimizer->blocks = NULL;
+    optimizer->predecessors = NULL;
+    optimizer->reversePostorder = NULL;
+    optimizer->blockCount = 0;
+}
+
+static void freeOptimizer(Optimizer *optimizer) {
+    freeBlocks(optimizer);
+    FREE_ARRAY(Instruction, optimizer->code, optimizer->count);
+    FREE_ARRAY(InlinedCode, optimizer->inlined, optimizer->inlinedCapacity);
+    initOptimizer(optimizer, optimizer->function, optimizer->isScript);
+}
+
+static usize addInlined(Optimizer *optimizer, ObjString *name, usize line) {
+    if (optimizer->inlinedCapacity < optimizer->inlinedCount + 1U) {
+        usize const oldCapacity = optimizer->inlinedCapacity;
+        optimizer->inlinedCapacity = GROW_CAPACITY(oldCapacity);
+        optimizer->inlined = GROW_ARRAY(InlinedCode, optimizer->inlined, oldCapacity, optimizer->inlinedCapacity);
+    }
+    InlinedCode *inlined = &optimizer->inlined[optimizer->inlinedCount++];
+    inlined->start = 0;
+    inlined->end = 0;
+    inlined->line = line;
+    inlined->name = name;
+    return optimizer->inlinedCount;
+}
+
+static bool decode(Optimizer *optimizer) {
+    Chunk const *chunk = &optimizer->function->chunk;
+    usize count = 0;
+    for (usize offset = 0; offset < chunk->count; offset += 1U + operandLength(chunk, offset)) {
+        // Functions big enough to need wide operands are left as they are
+        if (chunk->code[offset] == OP_WIDE) { return false; }
+        ++count;
+    }
+
+    usize *indexOf = ALLOCATE(usize, chunk->count + 1U);
+    for (usize offset = 0; offset <= chunk->count; ++offset) { indexOf[offset] = SIZE_MAX; }
+    optimizer->code = ALLOCATE(Instruction, count);
+    optimizer->count = count;
+    optimizer->header = SIZE_MAX;
+    optimizer->hoistedCount = 0;
+    for (usize i = 0; i < chunk->inlinedCount; ++i) {
+        usize const id = addInlined(optimizer, chunk->inlined[i].name, chunk->inlined[i].line);
+        optimizer->inlined[id - 1U].start = chunk->inlined[i].start;
+        optimizer->inlined[id - 1U].end = chunk->inlined[i].end;
+    }
+
+    usize offset = 0;
+    for (usize i = 0; i < count; ++i) {
+        Instruction *instruction = &optimizer->code[i];
+        u8 const *bytes = &chunk->code[offset];
+        indexOf[offset] = i;
+        instruction->op = bytes[0];
+        instruction->operand = 0;
+        instruction->argCount = 0;
+        instruction->popsBefore = 0;
+        instruction->popsAfter = 0;
+        instruction->isLeader = i == 0;
+        instruction->isRemoved = false;
+        instruction->shiftSlots = false;
+        instruction->depth = -1;
+        instruction->length = 1U + operandLength(chunk, offset);
+        instruction->offset = offset;
+        instruction->line = chunk->lines[offset];
+        instruction->target = offset;
+        instruction->block = 0;
+        instruction->inlined = 0;
+        for (usize j = 0; j < optimizer->inlinedCount; ++j) {
+            InlinedCode const *inlined = &optimizer->inlined[j];
+            if (offset >= inlined->start && offset < inlined->end) { instruction->inlined = j + 1U; }
+        }
+
+        if (instruction->length > 1U) { instruction->operand = bytes[1]; }
+        switch (instruction->op) {
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+            instruction->argCount = bytes[2];
+            break;
+        case OP_GUARD_CALLEE:
+            instruction->argCount = bytes[2];
+            instruction->target = offset + 5U + (usize)((bytes[3] << 8U) | bytes[4]);
+            break;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+            instruction->target = offset + 3U + (usize)((bytes[1] << 8U) | bytes[2]);
+            break;
+        case OP_LOOP:
+            instruction->target = offset + 3U - (usize)((bytes[1] << 8U) | bytes[2]);
+            break;
+        case OP_FOR_ITER:
+            instruction->target = offset + 4U + (usize)((bytes[2] << 8U) | bytes[3]);
+            break;
+        default:
+            break;
+        }
+        offset += instruction->length;
+    }
+
+    bool isValid = true;
+    for (usize i = 0; i < count; ++i) {
+        Instruction *instruction = &optimizer->code[i];
+        if (!isJump(instruction->op)) { continue; }
+        if (instruction->target > chunk->count || indexOf[instruction->target] >= count) {
+            isValid = false;
+            break;
+        }
+        instruction->target = indexOf[instruction->target];
+    }
+    FREE_ARRAY(usize, indexOf, chunk->count + 1U);
+    return isValid;
+}
+
+static usize nextKept(Optimizer const *optimizer, usize index) {
+    ++index;
+    while (index < optimizer->count && optimizer->code[index].isRemoved) { ++index; }
+    return index;
+}
+
+// Where a jump to `index` really lands once removed instructions are gone
+static usize landing(Optimizer const *optimizer, usize index) {
+    return optimizer->code[index].isRemoved ? nextKept(optimizer, index) : index;
+}
+
+static void findBlocks(Optimizer *optimizer) {
+    Instruction *code = optimizer->code;
+    for (usize i = 0; i < optimizer->count; ++i) {
+        if (isJump(code[i].op)) { code[code[i].target].isLeader = true; }
+        if (endsBlock(code[i].op) && i + 1U < optimizer->count) { code[i + 1U].isLeader = true; }
+    }
+
+    optimizer->blocks = ALLOCATE(Block, optimizer->count);
+    optimizer->blockCount = 0;
+    for (usize i = 0; i < optimizer->count; ++i) {
+        if (code[i].isLeader) {
+            Block *block = &optimizer->blocks[optimizer->blockCount++];
+            block->start = i;
+            block->successorCount = 0;
+            block->predecessorCount = 0;
+            block->idom = NOT_REACHED;
+            block->order = NOT_REACHED;
+        }
+        code[i].block = optimizer->blockCount - 1U;
+        optimizer->blocks[optimizer->blockCount - 1U].end = i + 1U;
+    }
+
+    optimizer->predecessors = ALLOCATE(usize, 2U * optimizer->count);
+    optimizer->predecessorCount = 0;
+    for (usize b = 0; b < optimizer->blockCount; ++b) {
+        Block *block = &optimizer->blocks[b];
+        Instruction const *last = &code[block->end - 1U];
+        if (last->op != OP_JUMP && last->op != OP_LOOP && last->op != OP_RETURN
+            && b + 1U < optimizer->blockCount) {
+            block->successors[block->successorCount++] = b + 1U;
+        }
+        if (isJump(last->op)) {
+            block->successors[block->successorCount++] = code[last->target].block;
+        }
+        for (usize s = 0; s < block->successorCount; ++s) {
+            ++optimizer->blocks[block->successors[s]].predecessorCount;
+        }
+    }
+    usize start = 0;
+    for (usize b = 0; b < optimizer->blockCount; ++b) {
+        optimizer->blocks[b].predecessorStart = start;
+        start += optimizer->blocks[b].predecessorCount;
+        optimizer->blocks[b].predecessorCount = 0;
+    }
+    for (usize b = 0; b < optimizer->blockCount; ++b) {
+        Block const *block = &optimizer->blocks[b];
+        for (usize s = 0; s < block->successorCount; ++s) {
+            Block *successor = &optimizer->blocks[block->successors[s]];
+            optimizer->predecessors[successor->predecessorStart + successor->predecessorCount++] = b;
+        }
+    }
+    optimizer->predecessorCount = start;
+}
+
+static void orderBlocks(Optimizer *optimizer) {
+    // Iterative depth-first search; `next` is the successor to visit next
+    usize *stack = ALLOCATE(usize, optimizer->blockCount);
+    usize *next = ALLOCATE(usize, optimizer->blockCount);
+    bool *isVisited = ALLOCATE(bool, optimizer->blockCount);
+    for (usize b = 0; b < optimizer->blockCount; ++b) { isVisited[b] = false; }
+
+    optimizer->reversePostorder = ALLOCATE(usize, optimizer->count);
+    usize postorderCount = 0;
+    usize depth = 0;
+    stack[depth] = 0;
+    next[depth++] = 0;
+    isVisited[0] = true;
+    while (depth > 0) {
+        Block const *block = &optimizer->blocks[stack[depth - 1U]];
+        if (next[depth - 1U] < block->successorCount) {
+            usize const successor = block->successors[next[depth - 1U]++];
+            if (!isVisited[successor]) {
+                isVisited[successor] = true;
+                stack[depth] = successor;
+                next[depth++] = 0;
+            }
+            continue;
+        }
+        optimizer->reversePostorder[postorderCount++] = stack[--depth];
+    }
+    for (usize i = 0; i < postorderCount / 2U; ++i) {
+        usize const swap = optimizer->reversePostorder[i];
+        optimizer->reversePostorder[i] = optimizer->reversePostorder[postorderCount - 1U - i];
+        optimizer->reversePostorder[postorderCount - 1U - i] = swap;
+    }
+    optimizer->reachableCount = postorderCount;
+    for (usize i = 0; i < postorderCount; ++i) {
+        optimizer->blocks[optimizer->reversePostorder[i]].order = i;
+    }
+
+    FREE_ARRAY(bool, isVisited, optimizer->blockCount);
+    FREE_ARRAY(usize, next, optimizer->blockCount);
+    FREE_ARRAY(usize, stack, optimizer->blockCount);
+}
+
+static usize intersect(Optimizer const *optimizer, usize a, usize b) {
+    Block const *blocks = optimizer->blocks;
+    while (a != b) {
+        while (blocks[a].order > blocks[b].order) { a = blocks[a].idom; }
+        while (blocks[b].order > blocks[a].order) { b = blocks[b].idom; }
+    }
+    return a;
+}
+
+// Cooper, Harvey and Kennedy's iterative dominator algorithm
+static void findDominators(Optimizer *optimizer) {
+    Block *blocks = optimizer->blocks;
+    blocks[0].idom = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (usize i = 1; i < optimizer->reachableCount; ++i) {
+            Block *block = &blocks[optimizer->reversePostorder[i]];
+            usize idom = NOT_REACHED;
+            for (usize p = 0; p < block->predecessorCount; ++p) {
+                usize const predecessor = optimizer->predecessors[block->predecessorStart + p];
+                if (blocks[predecessor].idom == NOT_REACHED) { continue; }
+                idom = idom == NOT_REACHED ? predecessor : intersect(optimizer, predecessor, idom);
+            }
+            if (block->idom != idom) {
+                block->idom = idom;
+                changed = true;
+            }
+        }
+    }
+}
+
+static bool dominates(Optimizer const *optimizer, usize dominator, usize block) {
+    if (optimizer->blocks[block].order == NOT_REACHED) { return false; }
+    while (true) {
+        if (block == dominator) { return true; }
+        if (block == 0) { return false; }
+        block = optimizer->blocks[block].idom;
+    }
+}
+
+// Stack depth along the edge from a block to one of its successors
+static i32 edgeDepth(Optimizer const *optimizer, usize from, usize to) {
+    Instruction const *last = &optimizer->code[optimizer->blocks[from].end - 1U];
+    bool const isTaken = isJump(last->op) && optimizer->code[last->target].block == to
+                         && (last->op == OP_JUMP || last->op == OP_LOOP || from + 1U != to);
+    return isTaken ? last->depth : last->depth + stackEffect(last);
+}
+
+static void findDepths(Optimizer *optimizer) {
+    Instruction *code = optimizer->code;
+    optimizer->hasDepths = true;
+    optimizer->maxDepth = 0;
+    code[0].depth = (i32)optimizer->function->arity + 1;
+    for (usize i = 0; i < optimizer->reachableCount; ++i) {
+        usize const b = optimizer->reversePostorder[i];
+        Block const *block = &optimizer->blocks[b];
+        for (usize j = block->start + 1U; j < block->end; ++j) {
+            code[j].depth = code[j - 1U].depth + stackEffect(&code[j - 1U]);
+        }
+        for (usize j = block->start; j < block->end; ++j) {
+            if (code[j].depth < 0) { optimizer->hasDepths = false; }
+            if (code[j].depth + 1 > optimizer->maxDepth) { optimizer->maxDepth = code[j].depth + 1; }
+        }
+        for (usize s = 0; s < block->successorCount; ++s) {
+            Instruction *first = &code[optimizer->blocks[block->successors[s]].start];
+            i32 const depth = edgeDepth(optimizer, b, block->successors[s]);
+            if (first->depth == -1) {
+                first->depth = depth;
+            } else if (first->depth != depth) {
+                optimizer->hasDepths = false;
+            }
+        }
+    }
+}
+
+static bool analyze(Optimizer *optimizer) {
+    if (!decode(optimizer)) { return false; }
+    findBlocks(optimizer);
+    orderBlocks(optimizer);
+    findDominators(optimizer);
+    findDepths(optimizer);
+    return true;
+}
+
+static void emitByte(u8 *code, usize *lines, usize *offset, u8 byte, usize line) {
+    code[*offset] = byte;
+    lines[*offset] = line;
+    ++*offset;
+}
+
+static u8 shiftSlot(Optimizer const *optimizer, Instruction const *instruction, u8 slot) {
+    if (!instruction->shiftSlots || slot < optimizer->shiftFrom) { return slot; }
+    return (u8)(slot + optimizer->hoistedCount);
+}
+
+// Writes the instructions back as bytecode. Fails, leaving the chunk as it
+// was, when a jump no longer fits in 16 bits.
+static bool lower(Optimizer const *optimizer) {
+    Chunk *chunk = &optimizer->function->chunk;
+    Instruction const *code = optimizer->code;
+
+    usize *entries = ALLOCATE(usize, optimizer->count + 1U);
+    usize count = 0;
+    for (usize i = 0; i < optimizer->count; ++i) {
+        if (i == optimizer->header) { count += 2U * optimizer->hoistedCount; }
+        entries[i] = count;
+        if (code[i].isRemoved) { continue; }
+        count += code[i].popsBefore + code[i].length + code[i].popsAfter;
+    }
+    entries[optimizer->count] = count;
+
+    u8 *bytes = ALLOCATE(u8, count);
+    usize *lines = ALLOCATE(usize, count);
+    InlinedCode *inlined = ALLOCATE(InlinedCode, optimizer->inlinedCount);
+    for (usize j = 0; j < optimizer->inlinedCount; ++j) {
+        inlined[j] = optimizer->inlined[j];
+        inlined[j].start = SIZE_MAX;
+        inlined[j].end = 0;
+    }
+    usize offset = 0;
+    bool fits = true;
+    for (usize i = 0; i < optimizer->count && fits; ++i) {
+        Instruction const *instruction = &code[i];
+        usize const line = instruction->line;
+        if (i == optimizer->header) {
+            for (usize h = 0; h < optimizer->hoistedCount; ++h) {
+                emitByte(bytes, lines, &offset, OP_GET_GLOBAL, line);
+                emitByte(bytes, lines, &offset, optimizer->hoisted[h], line);
+            }
+        }
+        if (instruction->isRemoved) { continue; }
+        for (u8 p = 0; p < instruction->popsBefore; ++p) { emitByte(bytes, lines, &offset, OP_POP, line); }
+
+        if (instruction->inlined > 0) {
+            InlinedCode *range = &inlined[instruction->inlined - 1U];
+            if (offset < range->start) { range->start = offset; }
+            range->end = offset + instruction->length;
+        }
+
+        usize const landsOn = isJump(instruction->op) ? landing(optimizer, instruction->target) : i;
+        usize const target = entries[landsOn];
+        switch (instruction->op) {
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_JUMP_IF_FALSE: {
+            bool const isBackward = landsOn <= i;
+            u8 op = instruction->op;
+            if (op != OP_JUMP_IF_FALSE) { op = isBackward ? OP_LOOP : OP_JUMP; }
+            usize const distance = isBackward ? offset + 3U - target : target - offset - 3U;
+            fits = distance <= UINT16_MAX && (op != OP_JUMP_IF_FALSE || !isBackward);
+            emitByte(bytes, lines, &offset, op, line);
+            emitByte(bytes, lines, &offset, (u8)(distance >> 8U), line);
+            emitByte(bytes, lines, &offset, (u8)distance, line);
+            break;
+        }
+        case OP_FOR_ITER: {
+            usize const distance = target - offset - 4U;
+            fits = landsOn > i && distance <= UINT16_MAX;
+            emitByte(bytes, lines, &offset, OP_FOR_ITER, line);
+            emitByte(bytes, lines, &offset, shiftSlot(optimizer, instruction, instruction->operand), line);
+            emitByte(bytes, lines, &offset, (u8)(distance >> 8U), line);
+            emitByte(bytes, lines, &offset, (u8)distance, line);
+            break;
+        }
+        case OP_GUARD_CALLEE: {
+            usize const distance = target - offset - 5U;
+            fits = landsOn > i && distance <= UINT16_MAX;
+            emitByte(bytes, lines, &offset, OP_GUARD_CALLEE, line);
+            emitByte(bytes, lines, &offset, instruction->operand, line);
+            emitByte(bytes, lines, &offset, instruction->argCount, line);
+            emitByte(bytes, lines, &offset, (u8)(distance >> 8U), line);
+            emitByte(bytes, lines, &offset, (u8)distance, line);
+            break;
+        }
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+            emitByte(bytes, lines, &offset, instruction->op, line);
+            emitByte(bytes, lines, &offset, shiftSlot(optimizer, instruction, instruction->operand), line);
+            break;
+        case OP_CLOSURE: {
+            emitByte(bytes, lines, &offset, OP_CLOSURE, line);
+            emitByte(bytes, lines, &offset, instruction->operand, line);
+            usize const end = instruction->offset + instruction->length;
+            for (usize pair = instruction->offset + 2U; pair < end; pair += 2U) {
+                u8 const flags = chunk->code[pair];
+                u8 index = chunk->code[pair + 1U];
+                if (flags & UPVALUE_LOCAL) { index = shiftSlot(optimizer, instruction, index); }
+                emitByte(bytes, lines, &offset, flags, line);
+                emitByte(bytes, lines, &offset, index, line);
+            }
+            break;
+        }
+        default:
+            emitByte(bytes, lines, &offset, instruction->op, line);
+            if (instruction->length > 1U) { emitByte(bytes, lines, &offset, instruction->operand, line); }
+            if (instruction->length > 2U) { emitByte(bytes, lines, &offset, instruction->argCount, line); }
+            break;
+        }
+        for (u8 p = 0; p < instruction->popsAfter; ++p) { emitByte(bytes, lines, &offset, OP_POP, line); }
+    }
+    FREE_ARRAY(usize, entries, optimizer->count + 1U);
+
+    if (!fits) {
+        FREE_ARRAY(u8, bytes, count);
+        FREE_ARRAY(usize, lines, count);
+        FREE_ARRAY(InlinedCode, inlined, optimizer->inlinedCount);
+        return false;
+    }
+    FREE_ARRAY(u8, chunk->code, chunk->capacity);
+    FREE_ARRAY(usize, chunk->lines, chunk->capacity);
+    chunk->code = bytes;
+    chunk->lines = lines;
+    chunk->count = count;
+    chunk->capacity = count;
+
+    // Inlined code that was optimized away entirely leaves an empty range
+    usize inlinedCount = 0;
+    for (usize j = 0; j < optimizer->inlinedCount; ++j) {
+        if (inlined[j].start < inlined[j].end) { inlined[inlinedCount++] = inlined[j]; }
+    }
+    FREE_ARRAY(InlinedCode, chunk->inlined, chunk->inlinedCount);
+    chunk->inlined = GROW_ARRAY(InlinedCode, inlined, optimizer->inlinedCount, inlinedCount);
+    chunk->inlinedCount = inlinedCount;
+    return true;
+}
+
+static bool isLiteral(u8 op) {
+    return op == OP_CONSTANT || op == OP_NIL || op == OP_TRUE || op == OP_FALSE;
+}
+
+static bool isFalseyLiteral(Optimizer const *optimizer, Instruction const *instruction) {
+    if (instruction->op == OP_CONSTANT) {
+        Value const value = optimizer->function->chunk.constants.values[instruction->operand];
+        return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+    }
+    return instruction->op != OP_TRUE;
+}
+
+// A literal followed by OP_JUMP_IF_FALSE always goes the same way
+static bool foldBranches(Optimizer *optimizer) {
+    bool changed = false;
+    for (usize i = 0; i < optimizer->count; i = nextKept(optimizer, i)) {
+        Instruction const *literal = &optimizer->code[i];
+        usize const next = nextKept(optimizer, i);
+        if (literal->isRemoved || !isLiteral(literal->op) || next == optimizer->count) { continue; }
+        Instruction *branch = &optimizer->code[next];
+        if (branch->op != OP_JUMP_IF_FALSE || branch->isLeader) { continue; }
+        if (isFalseyLiteral(optimizer, literal)) {
+            branch->op = OP_JUMP;
+        } else {
+            branch->isRemoved = true;
+        }
+        changed = true;
+    }
+    return changed;
+}
+
+// Jumps to a jump go straight to where the second one goes, and a jump to
+// the instruction after it disappears. A conditional jump that lands on
+// another one testing the same value takes the second one's branch.
+static bool threadJumps(Optimizer *optimizer) {
+    bool changed = false;
+    for (usize i = 0; i < optimizer->count; ++i) {
+        Instruction *jump = &optimizer->code[i];
+        if (jump->isRemoved || !isJump(jump->op)) { continue; }
+        bool const isConditional = jump->op != OP_JUMP && jump->op != OP_LOOP;
+        usize target = landing(optimizer, jump->target);
+        for (i32 step = 0; step < MAX_ROUNDS && target < optimizer->count; ++step) {
+            Instruction const *next = &optimizer->code[target];
+            bool const follows = next->op == OP_JUMP || next->op == OP_LOOP
+                                 || (jump->op == OP_JUMP_IF_FALSE && next->op == OP_JUMP_IF_FALSE);
+            if (!follows) { break; }
+            usize const nextTarget = landing(optimizer, next->target);
+            if (nextTarget == target || (isConditional && nextTarget <= i)) { break; }
+            target = nextTarget;
+        }
+        if (target != landing(optimizer, jump->target)) {
+            jump->target = target;
+            changed = true;
+        }
+        if ((!isConditional || jump->op == OP_JUMP_IF_FALSE) && target == nextKept(optimizer, i)) {
+            jump->isRemoved = true;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+static bool removeUnreachable(Optimizer *optimizer) {
+    bool changed = false;
+    for (usize b = 0; b < optimizer->blockCount; ++b) {
+        Block const *block = &optimizer->blocks[b];
+        if (block->order != NOT_REACHED) { continue; }
+        for (usize i = block->start; i < block->end; ++i) {
+            changed = changed || !optimizer->code[i].isRemoved;
+            optimizer->code[i].isRemoved = true;
+        }
+    }
+    return changed;
+}
+
+static bool isPurePush(u8 op) {
+    return isLiteral(op) || op == OP_GET_LOCAL || op == OP_GET_UPVALUE || op == OP_GET_FLAT_UPVALUE;
+}
+
+static bool isSameVariable(Optimizer const *optimizer, Instruction const *set, Instruction const *get) {
+    switch (set->op) {
+    case OP_SET_LOCAL:
+        return get->op == OP_GET_LOCAL && get->operand == set->operand;
+    case OP_SET_UPVALUE:
+        return get->op == OP_GET_UPVALUE && get->operand == set->operand;
+    case OP_SET_GLOBAL:
+        return get->op == OP_GET_GLOBAL
+               && constantString(optimizer, get->operand) == constantString(optimizer, set->operand);
+    default:
+        return false;
+    }
+}
+
+// Pushes that are popped straight away, and loads of the variable that was
+// just stored to, whose value is still on the stack
+static bool removeDeadCode(Optimizer *optimizer) {
+    bool changed = false;
+    for (usize i = 0; i < optimizer->count; i = nextKept(optimizer, i)) {
+        Instruction *first = &optimizer->code[i];
+        usize const j = nextKept(optimizer, i);
+        if (first->isRemoved || j == optimizer->count || optimizer->code[j].isLeader) { continue; }
+        Instruction *second = &optimizer->code[j];
+        if (second->op != OP_POP) { continue; }
+
+        if (isPurePush(first->op)) {
+            first->isRemoved = true;
+            second->isRemoved = true;
+            changed = true;
+            continue;
+        }
+        if (first->op == OP_NOT) {
+            first->isRemoved = true;
+            changed = true;
+            continue;
+        }
+        usize const k = nextKept(optimizer, j);
+        if (k == optimizer->count || optimizer->code[k].isLeader) { continue; }
+        if (isSameVariable(optimizer, first, &optimizer->code[k])) {
+            second->isRemoved = true;
+            optimizer->code[k].isRemoved = true;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// Runs the cleanup passes until they find nothing more to do
+static void simplify(Optimizer *optimizer) {
+    for (i32 round = 0; round < MAX_ROUNDS; ++round) {
+        if (!analyze(optimizer)) {
+            freeOptimizer(optimizer);
+            return;
+        }
+        bool changed = removeUnreachable(optimizer);
+        changed = foldBranches(optimizer) || changed;
+        changed = threadJumps(optimizer) || changed;
+        changed = removeDeadCode(optimizer) || changed;
+        bool const lowered = changed && lower(optimizer);
+        freeOptimizer(optimizer);
+        if (!lowered) { return; }
+    }
+}
+
+static bool isInLoop(Optimizer const *optimizer, bool const *inLoop, usize instruction) {
+    return inLoop[optimizer->code[instruction].block];
+}
+
+static bool hasCall(Optimizer const *optimizer, bool const *inLoop) {
+    for (usize i = 0; i < optimizer->count; ++i) {
+        if (!isInLoop(optimizer, inLoop, i)) { continue; }
+        u8 const op = optimizer->code[i].op;
+        if (op == OP_CALL || op == OP_INVOKE || op == OP_SUPER_INVOKE || op == OP_FOR_ITER) { return true; }
+    }
+    return false;
+}
+
+static bool writesGlobal(Optimizer const *optimizer, bool const *inLoop, ObjString *name) {
+    for (usize i = 0; i < optimizer->count; ++i) {
+        Instruction const *instruction = &optimizer->code[i];
+        if (!isInLoop(optimizer, inLoop, i)) { continue; }
+        if ((instruction->op == OP_SET_GLOBAL || instruction->op == OP_DEFINE_GLOBAL)
+            && constantString(optimizer, instruction->operand) == name) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// A global exists when the loop is entered if it already did at compile
+// time, as globals are never removed, or if an instruction that fails
+// without it runs on every path to the loop
+static bool isDefinedBefore(Optimizer const *optimizer, usize header, ObjString *name) {
+    Value ignored;  // NOLINT
+    if (tableGet(&vm.globals, name, &ignored)) { return true; }
+    usize b = header;
+    while (b != 0) {
+        b = optimizer->blocks[b].idom;
+        Block const *block = &optimizer->blocks[b];
+        for (usize i = block->start; i < block->end; ++i) {
+            Instruction const *instruction = &optimizer->code[i];
+            if ((instruction->op == OP_DEFINE_GLOBAL || instruction->op == OP_GET_GLOBAL)
+                && constantString(optimizer, instruction->operand) == name) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// The loop must be entered only by falling into its header, and leave
+// either with nothing of its own on the stack or with just the condition
+// that the exit pops. The new slots are popped on the way out.
+static bool placeExitPops(Optimizer *optimizer, bool const *inLoop, i32 depth, u8 pops) {
+    for (usize pass = 0; pass < 2U; ++pass) {
+        for (usize b = 0; b < optimizer->blockCount; ++b) {
+            if (!inLoop[b]) { continue; }
+            Block const *block = &optimizer->blocks[b];
+            for (usize s = 0; s < block->successorCount; ++s) {
+                usize const exit = block->successors[s];
+                if (inLoop[exit]) { continue; }
+                Block const *exitBlock = &optimizer->blocks[exit];
+                for (usize p = 0; p < exitBlock->predecessorCount; ++p) {
+                    if (!inLoop[optimizer->predecessors[exitBlock->predecessorStart + p]]) { return false; }
+                }
+                Instruction *first = &optimizer->code[exitBlock->start];
+                i32 const extra = edgeDepth(optimizer, b, exit) - depth;
+                bool const popsCondition = extra == 1 && first->op == OP_POP && exitBlock->end - exitBlock->start > 1U;
+                if (extra != 0 && !popsCondition) { return false; }
+                if (pass == 1U && extra == 0) { first->popsBefore = pops; }
+                if (pass == 1U && extra == 1) { first->popsAfter = pops; }
+            }
+        }
+    }
+    return true;
+}
+
+// Loop-invariant code motion for global loads. A global that nothing in the
+// loop can assign is loaded once into a new slot before the loop. Calls may
+// run any function, so loops with calls qualify only in the script, which
+// is optimized after every function it can call has been compiled and seen
+// by recordAssignedGlobals.
+static bool hoistLoads(Optimizer *optimizer, usize header) {
+    if (!optimizer->hasDepths || header == 0) { return false; }
+    Block const *blocks = optimizer->blocks;
+    Instruction *code = optimizer->code;
+
+    bool *inLoop = ALLOCATE(bool, optimizer->blockCount);
+    usize *work = ALLOCATE(usize, optimizer->blockCount);
+    usize workCount = 0;
+    for (usize b = 0; b < optimizer->blockCount; ++b) { inLoop[b] = false; }
+    inLoop[header] = true;
+    Block const *headerBlock = &blocks[header];
+    for (usize p = 0; p < headerBlock->predecessorCount; ++p) {
+        usize const latch = optimizer->predecessors[headerBlock->predecessorStart + p];
+        if (dominates(optimizer, header, latch) && !inLoop[latch]) {
+            inLoop[latch] = true;
+            work[workCount++] = latch;
+        }
+    }
+    while (workCount > 0) {
+        Block const *block = &blocks[work[--workCount]];
+        for (usize p = 0; p < block->predecessorCount; ++p) {
+            usize const predecessor = optimizer->predecessors[block->predecessorStart + p];
+            if (!inLoop[predecessor]) {
+                inLoop[predecessor] = true;
+                work[workCount++] = predecessor;
+            }
+        }
+    }
+    FREE_ARRAY(usize, work, optimizer->blockCount);
+
+    bool canHoist = true;
+    for (usize p = 0; p < headerBlock->predecessorCount; ++p) {
+        usize const entry = optimizer->predecessors[headerBlock->predecessorStart + p];
+        if (inLoop[entry]) { continue; }
+        Instruction const *last = &code[blocks[entry].end - 1U];
+        canHoist = canHoist && entry + 1U == header && last->op != OP_JUMP && last->op != OP_LOOP
+                   && (!isJump(last->op) || code[last->target].block != header);
+    }
+
+    i32 const depth = code[headerBlock->start].depth;
+    bool const mayCall = hasCall(optimizer, inLoop);
+    for (usize i = 0; canHoist && i < optimizer->count; ++i) {
+        Instruction *load = &code[i];
+        if (!inLoop[load->block]) { continue; }
+        if (load->depth < depth) { canHoist = false; }
+        if (load->op != OP_GET_GLOBAL || optimizer->hoistedCount == UINT8_COUNT) { continue; }
+        ObjString *name = constantString(optimizer, load->operand);
+        bool isHoisted = false;
+        for (usize h = 0; h < optimizer->hoistedCount; ++h) {
+            isHoisted = isHoisted || constantString(optimizer, optimizer->hoisted[h]) == name;
+        }
+        Value ignored;  // NOLINT
+        if (isHoisted || writesGlobal(optimizer, inLoop, name)
+            || (mayCall && (!optimizer->isScript || tableGet(&vm.assignedGlobals, name, &ignored)))
+            || !isDefinedBefore(optimizer, header, name)) {
+            continue;
+        }
+        optimizer->hoisted[optimizer->hoistedCount++] = load->operand;
+    }
+
+    canHoist = canHoist && optimizer->hoistedCount > 0
+               && optimizer->maxDepth + (i32)optimizer->hoistedCount <= (i32)UINT8_COUNT
+               && placeExitPops(optimizer, inLoop, depth, (u8)optimizer->hoistedCount);
+    if (canHoist) {
+        optimizer->header = headerBlock->start;
+        optimizer->shiftFrom = (u8)depth;
+        for (usize i = 0; i < optimizer->count; ++i) {
+            Instruction *instruction = &code[i];
+            if (!inLoop[instruction->block]) { continue; }
+            instruction->shiftSlots = true;
+            if (instruction->op != OP_GET_GLOBAL) { continue; }
+            for (usize h = 0; h < optimizer->hoistedCount; ++h) {
+                if (constantString(optimizer, optimizer->hoisted[h]) != constantString(optimizer, instruction->operand)) {
+                    continue;
+                }
+                instruction->op = OP_GET_LOCAL;
+                instruction->operand = (u8)(depth + (i32)h);
+                instruction->shiftSlots = false;
+                break;
+            }
+        }
+    }
+    FREE_ARRAY(bool, inLoop, optimizer->blockCount);
+    return canHoist;
+}
+
+// Tries each loop in turn, outermost first, until one of them changes
+static bool hoistAnyLoop(Optimizer *optimizer) {
+    if (!analyze(optimizer)) {
+        freeOptimizer(optimizer);
+        return false;
+    }
+    usize const blockCount = optimizer->blockCount;
+    freeOptimizer(optimizer);
+
+    for (usize header = 1; header < blockCount; ++header) {
+        if (!analyze(optimizer)) { break; }
+        bool isHeader = false;
+        Block const *block = &optimizer->blocks[header];
+        for (usize p = 0; block->order != NOT_REACHED && p < block->predecessorCount; ++p) {
+            isHeader = isHeader || dominates(optimizer, header, optimizer->predecessors[block->predecessorStart + p]);
+        }
+        bool const hoisted = isHeader && hoistLoads(optimizer, header) && lower(optimizer);
+        freeOptimizer(optimizer);
+        if (hoisted) { return true; }
+    }
+    return false;
+}
+
+static bool isInlinable(u8 op) {
+    switch (op) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_PRINT:
+    case OP_POP:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_LIST:
+    case OP_MAP:
+    case OP_GET_INDEX:
+    case OP_SET_INDEX:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool hasConstantOperand(u8 op) {
+    return op == OP_CONSTANT || op == OP_GET_GLOBAL || op == OP_SET_GLOBAL
+           || op == OP_GET_PROPERTY || op == OP_SET_PROPERTY;
+}
+
+// Index of the constant in the function's pool, adding it if needed, or -1
+// when it does not fit in a one-byte operand
+static i32 reuseConstant(ObjFunction *function, Value value) {
+    usize constant;  // NOLINT
+    if (findConstant(&function->chunk, value, &constant)) { return constant <= UINT8_MAX ? (i32)constant : -1; }
+    if (function->chunk.constants.count >= UINT8_COUNT) { return -1; }
+    return (i32)addConstant(&function->chunk, value);
+}
+
+// Only straight-line functions without calls, closures or upvalues are
+// inlined, so inlining never changes how deep the call stack gets
+static void addInlinee(Inlinees *inlinees, ObjString *name, ObjFunction *function) {
+    if (function->upvalueCount > 0) { return; }
+    Optimizer callee;
+    initOptimizer(&callee, function, false);
+    bool isSmall = analyze(&callee) && callee.hasDepths && callee.count <= INLINE_MAX_INSTRUCTIONS + 1U
+                   && callee.code[callee.count - 1U].op == OP_RETURN;
+    for (usize i = 0; isSmall && i + 1U < callee.count; ++i) { isSmall = isInlinable(callee.code[i].op); }
+    if (isSmall) {
+        if (inlinees->capacity < inlinees->count + 1U) {
+            usize const oldCapacity = inlinees->capacity;
+            inlinees->capacity = GROW_CAPACITY(oldCapacity);
+            inlinees->inlinees = GROW_ARRAY(Inlinee, inlinees->inlinees, oldCapacity, inlinees->capacity);
+        }
+        Inlinee *inlinee = &inlinees->inlinees[inlinees->count++];
+        inlinee->name = name;
+        inlinee->function = function;
+        inlinee->bodyCount = callee.count - 1U;
+        inlinee->body = ALLOCATE(Instruction, inlinee->bodyCount);
+        memcpy(inlinee->body, callee.code, sizeof(Instruction) * inlinee->bodyCount);
+        inlinee->returnDepth = callee.code[callee.count - 1U].depth;
+        inlinee->maxDepth = callee.maxDepth;
+    }
+    freeOptimizer(&callee);
+}
+
+// Functions the script declares as globals
+static void findInlinees(Inlinees *inlinees, ObjFunction *script) {
+    Optimizer optimizer;
+    initOptimizer(&optimizer, script, true);
+    if (decode(&optimizer)) {
+        for (usize i = 0; i + 1U < optimizer.count; ++i) {
+            Instruction const *closure = &optimizer.code[i];
+            Instruction const *define = &optimizer.code[i + 1U];
+            if (closure->op != OP_CLOSURE || define->op != OP_DEFINE_GLOBAL) { continue; }
+            addInlinee(inlinees,
+                       constantString(&optimizer, define->operand),
+                       AS_FUNCTION(script->chunk.constants.values[closure->operand]));
+        }
+    }
+    freeOptimizer(&optimizer);
+}
+
+static void freeInlinees(Inlinees *inlinees) {
+    for (usize i = 0; i < inlinees->count; ++i) {
+        FREE_ARRAY(Instruction, inlinees->inlinees[i].body, inlinees->inlinees[i].bodyCount);
+    }
+    FREE_ARRAY(Inlinee, inlinees->inlinees, inlinees->capacity);
+}
+
+// The function a call site calls, if the callee comes straight from a
+// global that names an inlinee
+static Inlinee const *findCallee(Optimizer *optimizer, Inlinees const *inlinees, usize call) {
+    Instruction const *code = optimizer->code;
+    i32 const base = code[call].depth - (i32)code[call].operand - 1;
+    usize callee = call;
+    while (callee > 0 && code[callee - 1U].depth > base) { --callee; }
+    if (callee == 0 || code[callee - 1U].depth != base || code[callee - 1U].op != OP_GET_GLOBAL) { return NULL; }
+
+    ObjString *name = constantString(optimizer, code[callee - 1U].operand);
+    for (usize i = 0; i < inlinees->count; ++i) {
+        Inlinee const *inlinee = &inlinees->inlinees[i];
+        if (inlinee->name != name || inlinee->function == optimizer->function
+            || inlinee->function->arity != code[call].operand || base + inlinee->maxDepth > (i32)UINT8_COUNT) {
+            continue;
+        }
+        bool hasConstants = reuseConstant(optimizer->function, OBJ_VAL(inlinee->function)) >= 0;
+        for (usize b = 0; hasConstants && b < inlinee->bodyCount; ++b) {
+            Instruction const *instruction = &inlinee->body[b];
+            if (!hasConstantOperand(instruction->op)) { continue; }
+            Value const constant = inlinee->function->chunk.constants.values[instruction->operand];
+            hasConstants = reuseConstant(optimizer->function, constant) >= 0;
+        }
+        return hasConstants ? inlinee : NULL;
+    }
+    return NULL;
+}
+
+// Replaces calls of small global functions with the function's code. A
+// guard checks the callee is still that function and otherwise jumps to
+// the original call, placed after the end of the function:
+//
+//         OP_GUARD_CALLEE f -> call
+//         <code of f, with its slots moved to where the call put them>
+//         OP_INLINE_RETURN
+//   next: ...
+//   call: OP_CALL
+//         OP_JUMP next
+static bool inlineCalls(Optimizer *optimizer, Inlinees const *inlinees) {
+    if (inlinees->count == 0 || !analyze(optimizer) || !optimizer->hasDepths) { return false; }
+    usize const oldCount = optimizer->count;
+    Instruction const *code = optimizer->code;
+
+    Inlinee const **sites = ALLOCATE(Inlinee const *, oldCount);
+    usize *moved = ALLOCATE(usize, oldCount + 1U);
+    usize count = 0;
+    for (usize i = 0; i < oldCount; ++i) {
+        sites[i] = code[i].op == OP_CALL && code[i].depth >= 0 ? findCallee(optimizer, inlinees, i) : NULL;
+        moved[i] = count;
+        count += sites[i] != NULL ? sites[i]->bodyCount + 2U : 1U;
+    }
+    moved[oldCount] = count;
+    usize fallback = count;
+    for (usize i = 0; i < oldCount; ++i) {
+        if (sites[i] != NULL) { count += 2U; }
+    }
+    if (count == oldCount) {
+        FREE_ARRAY(usize, moved, oldCount + 1U);
+        FREE_ARRAY(Inlinee const *, sites, oldCount);
+        return false;
+    }
+
+    Instruction *rewritten = ALLOCATE(Instruction, count);
+    for (usize i = 0; i < oldCount; ++i) {
+        Instruction call = code[i];
+        if (isJump(call.op)) { call.target = moved[call.target]; }
+        Inlinee const *inlinee = sites[i];
+        if (inlinee == NULL) {
+            rewritten[moved[i]] = call;
+            continue;
+        }
+
+        i32 const base = call.depth - (i32)call.operand - 1;
+        usize at = moved[i];
+        Instruction *guard = &rewritten[at++];
+        *guard = call;
+        guard->op = OP_GUARD_CALLEE;
+        guard->operand = (u8)reuseConstant(optimizer->function, OBJ_VAL(inlinee->function));
+        guard->argCount = call.operand;
+        guard->length = 5U;
+        guard->target = fallback;
+
+        usize const inlined = addInlined(optimizer, inlinee->function->name, call.line);
+        for (usize b = 0; b < inlinee->bodyCount; ++b) {
+            Instruction *instruction = &rewritten[at++];
+            *instruction = inlinee->body[b];
+            instruction->inlined = inlined;
+            if (hasConstantOperand(instruction->op)) {
+                Value const constant = inlinee->function->chunk.constants.values[instruction->operand];
+                instruction->operand = (u8)reuseConstant(optimizer->function, constant);
+            }
+            if (instruction->op == OP_GET_LOCAL || instruction->op == OP_SET_LOCAL) {
+                instruction->operand = (u8)(base + instruction->operand);
+            }
+        }
+        Instruction *result = &rewritten[at];
+        *result = call;
+        result->op = OP_INLINE_RETURN;
+        result->operand = (u8)(inlinee->returnDepth - 1);
+        result->length = 2U;
+
+        rewritten[fallback] = call;
+        Instruction *back = &rewritten[fallback + 1U];
+        *back = call;
+        back->op = OP_JUMP;
+        back->length = 3U;
+        back->target = moved[i + 1U];
+        fallback += 2U;
+    }
+    FREE_ARRAY(usize, moved, oldCount + 1U);
+    FREE_ARRAY(Inlinee const *, sites, oldCount);
+
+    freeBlocks(optimizer);
+    FREE_ARRAY(Instruction, optimizer->code, oldCount);
+    optimizer->code = rewritten;
+    optimizer->count = count;
+    return lower(optimizer);
+}
+
+static void optimizeFunction(ObjFunction *function, bool isScript, Inlinees const *inlinees) {
+    Optimizer optimizer;
+    initOptimizer(&optimizer, function, isScript);
+    bool const inlined = inlineCalls(&optimizer, inlinees);
+    freeOptimizer(&optimizer);
+    if (inlined) { simplify(&optimizer); }
+    for (i32 round = 0; round < MAX_ROUNDS && hoistAnyLoop(&optimizer); ++round) {
+        simplify(&optimizer);
+    }
+#ifdef DEBUG_PRINT_CODE
+    disassembleChunk(&function->chunk, function->name != NULL ? function->name->chars : "<script>");
+#endif
+}
+
+static void recordAssignedGlobals(ObjFunction *function) {
+    Chunk const *chunk = &function->chunk;
+    for (usize offset = 0; offset < chunk->count; offset += 1U + operandLength(chunk, offset)) {
+        usize constant = SIZE_MAX;
+        if (chunk->code[offset] == OP_SET_GLOBAL) {
+            constant = chunk->code[offset + 1U];
+        } else if (chunk->code[offset] == OP_WIDE && chunk->code[offset + 1U] == OP_SET_GLOBAL) {
+            constant = (usize)(chunk->code[offset + 2U] << 8U) | chunk->code[offset + 3U];
+        }
+        if (constant != SIZE_MAX) {
+            tableSet(&vm.assignedGlobals, AS_STRING(chunk->constants.values[constant]), NIL_VAL);
+        }
+    }
+    for (usize i = 0; i < chunk->constants.count; ++i) {
+        if (IS_FUNCTION(chunk->constants.values[i])) { recordAssignedGlobals(AS_FUNCTION(chunk->constants.values[i])); }
+    }
+}
+
+typedef struct {
+    ObjFunction **functions;
+    usize count;
+    usize capacity;
+} Functions;
+
+// Nested functions come before the functions they are nested in
+static void findFunctions(Functions *functions, ObjFunction *function) {
+    Chunk const *chunk = &function->chunk;
+    for (usize i = 0; i < chunk->constants.count; ++i) {
+        if (IS_FUNCTION(chunk->constants.values[i])) { findFunctions(functions, AS_FUNCTION(chunk->constants.values[i])); }
+    }
+    if (functions->capacity < functions->count + 1U) {
+        usize const oldCapacity = functions->capacity;
+        functions->capacity = GROW_CAPACITY(oldCapacity);
+        functions->functions = GROW_ARRAY(ObjFunction *, functions->functions, oldCapacity, functions->capacity);
+    }
+    functions->functions[functions->count++] = function;
+}
+
+void optimizeProgram(ObjFunction *script) {
+    push(OBJ_VAL(script));
+    recordAssignedGlobals(script);
+    Functions functions = {NULL, 0, 0};
+    findFunctions(&functions, script);
+
+    // Inlinees are cleaned up before their code is copied anywhere
+    for (usize i = 0; i < functions.count; ++i) {
+        Optimizer optimizer;
+        initOptimizer(&optimizer, functions.functions[i], functions.functions[i] == script);
+        simplify(&optimizer);
+    }
+    Inlinees inlinees = {NULL, 0, 0};
+    findInlinees(&inlinees, script);
+    for (usize i = 0; i < functions.count; ++i) {
+        optimizeFunction(functions.functions[i], functions.functions[i] == script, &inlinees);
+    }
+
+    freeInlinees(&inlinees);
+    FREE_ARRAY(ObjFunction *, functions.functions, functions.capacity);
+    pop();
+}
@@ -0,0 +1,10 @@
+#ifndef CLOX_OPTIMIZER_H
+#define CLOX_OPTIMIZER_H
+
+#include "object.h"
+
+// Rewrites the bytecode of a compiled script and of every function nested
+// in it. Behaviour, including runtime errors and their lines, is unchanged.
+void optimizeProgram(ObjFunction *script);
+
+#endif
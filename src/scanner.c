@@ -3,12 +3,6 @@
 #include <stdio.h>
 #include <string.h>
 
-typedef struct {
-    const char *start;
-    const char *current;
-    usize line;
-} Scanner;
-
 Scanner scanner;  // NOLINT
 
 static Token makeToken(TokenType type) {
@@ -16,7 +10,8 @@ static Token makeToken(TokenType type) {
     return (Token){
         .type = type,
         .start = scanner.start,
-        .length = len};
+        .length = len,
+        .line = scanner.line};
 }
 
 static Token errorToken(const char *message) {
@@ -132,7 +127,14 @@ static TokenType identifierType(void) {
             }
         }
         break;
-    case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
+    case 'i':
+        if (scanner.current - scanner.start > 1) {
+            switch (scanner.start[1]) {
+            case 'f': return checkKeyword(2, 0, "", TOKEN_IF);
+            case 'n': return checkKeyword(2, 0, "", TOKEN_IN);
+            }
+        }
+        break;
     case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
     case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
     case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
@@ -163,6 +165,14 @@ void initScanner(const char *source) {
     scanner.line = 1U;
 }
 
+Scanner saveScanner(void) {
+    return scanner;
+}
+
+void restoreScanner(Scanner state) {
+    scanner = state;
+}
+
 Token scanToken(void) {
     skipWhitespace();
     scanner.start = scanner.current;
@@ -181,8 +191,11 @@ Token scanToken(void) {
     case ')': return makeToken(TOKEN_RIGHT_PAREN);
     case '{': return makeToken(TOKEN_LEFT_BRACE);
     case '}': return makeToken(TOKEN_RIGHT_BRACE);
+    case '[': return makeToken(TOKEN_LEFT_BRACKET);
+    case ']': return makeToken(TOKEN_RIGHT_BRACKET);
     case ';': return makeToken(TOKEN_SEMICOLON);
     case ',': return makeToken(TOKEN_COMMA);
+    case ':': return makeToken(TOKEN_COLON);
     case '.': return makeToken(TOKEN_DOT);
     case '-': return makeToken(TOKEN_MINUS);
     case '+': return makeToken(TOKEN_PLUS);
@@ -8,7 +8,10 @@ typedef enum {
     TOKEN_RIGHT_PAREN,
     TOKEN_LEFT_BRACE,
     TOKEN_RIGHT_BRACE,
+    TOKEN_LEFT_BRACKET,
+    TOKEN_RIGHT_BRACKET,
     TOKEN_COMMA,
+    TOKEN_COLON,
     TOKEN_DOT,
     TOKEN_MINUS,
     TOKEN_PLUS,
@@ -33,6 +36,7 @@ typedef enum {
     TOKEN_FOR,
     TOKEN_FUN,
     TOKEN_IF,
+    TOKEN_IN,
     TOKEN_NIL,
     TOKEN_OR,
     TOKEN_PRINT,
@@ -53,7 +57,15 @@ typedef struct {
     usize line;
 } Token;
 
+typedef struct {
+    const char *start;
+    const char *current;
+    usize line;
+} Scanner;
+
 void initScanner(const char *source);
 Token scanToken(void);
+Scanner saveScanner(void);
+void restoreScanner(Scanner state);
 
 #endif
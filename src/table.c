@@ -4,77 +4,229 @@
 #include "value.h"
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define TABLE_MAX_LOAD 0.75F
+#define TABLE_MIN_LOAD 0.25F
+#define GROUP_WIDTH 16U
+
+#define CONTROL_EMPTY ((u8)0x80U)
+
+// The low 7 bits of the hash are stored in the control byte, the rest pick
+// the home slot.
+#define HASH_HOME(hash) ((usize)((hash) >> 7U))
+#define HASH_TAG(hash) ((u8)((hash) & 0x7FU))
+
+#define IS_FULL(control) (((control) & 0x80U) == 0)
+
+// Bit i of each mask refers to control[i] of the group
+#ifdef __SSE2__
+
+typedef __m128i Group;
+
+static inline Group loadGroup(const u8 *control) {
+    return _mm_loadu_si128((const __m128i *)(const void *)control);
+}
+
+static inline u32 matchTag(Group group, u8 tag) {
+    return (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+}
+
+// Empty is the only control byte with the top bit set
+static inline u32 matchEmpty(Group group) {
+    return (u32)_mm_movemask_epi8(group);
+}
+
+#else
+
+typedef const u8 *Group;
+
+static inline Group loadGroup(const u8 *control) { return control; }
+
+static inline u32 matchTag(Group group, u8 tag) {
+    u32 mask = 0;
+    for (u32 i = 0; i < GROUP_WIDTH; ++i) {
+        if (group[i] == tag) { mask |= 1U << i; }
+    }
+    return mask;
+}
+
+static inline u32 matchEmpty(Group group) {
+    u32 mask = 0;
+    for (u32 i = 0; i < GROUP_WIDTH; ++i) {
+        if (!IS_FULL(group[i])) { mask |= 1U << i; }
+    }
+    return mask;
+}
+
+#endif
+
+static inline u32 lowestBit(u32 mask) { return (u32)__builtin_ctz(mask); }
+
+static void setControl(Table *table, usize index, u8 control) {
+    table->control[index] = control;
+    if (index < GROUP_WIDTH) { table->control[table->capacity + index] = control; }
+}
+
+#define IS_INLINE(table) ((table)->capacity == 0)
 
 void initTable(Table *table) {
     table->count = 0;
     table->capacity = 0;
-    table->entries = NULL;
 }
 
-static Entry *findEntry(Entry *entries, usize capacity, ObjString *key) {
-    usize index = key->hash & (capacity - 1U);
-    Entry *tombstone = NULL;
-    while (true) {
-        Entry *entry = &entries[index];
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                return tombstone != NULL ? tombstone : entry;
-            }
-            if (tombstone == NULL) { tombstone = entry; }
-        } else if (entry->key == key) {
-            return entry;
+// Returns the entry holding `key`, or NULL if it is not in the table
+static Entry *findEntry(Table *table, ObjString const *key) {
+    if (IS_INLINE(table)) {
+        for (usize i = 0; i < table->count; ++i) {
+            if (table->inlineEntries[i].key == key) { return &table->inlineEntries[i]; }
+        }
+        return NULL;
+    }
+
+    usize const mask = table->capacity - 1U;
+    u8 const tag = HASH_TAG(key->hash);
+    for (usize group = HASH_HOME(key->hash) & mask;; group = (group + GROUP_WIDTH) & mask) {
+        Group const controls = loadGroup(table->control + group);
+        for (u32 matches = matchTag(controls, tag); matches != 0; matches &= matches - 1U) {
+            usize const index = (group + lowestBit(matches)) & mask;
+            if (table->entries[index].key == key) { return &table->entries[index]; }
         }
-        index = (index + 1U) & (capacity - 1U);
+        if (matchEmpty(controls) != 0) { return NULL; }
+    }
+}
+
+// First empty slot at or after the home slot of `hash`. Every slot between
+// an entry's home and the entry itself is full, which is what lets
+// lookups stop at the first group with an empty slot.
+static usize findEmptySlot(u8 const *control, usize capacity, u32 hash) {
+    usize const mask = capacity - 1U;
+    for (usize group = HASH_HOME(hash) & mask;; group = (group + GROUP_WIDTH) & mask) {
+        u32 const empty = matchEmpty(loadGroup(control + group));
+        if (empty != 0) { return (group + lowestBit(empty)) & mask; }
     }
 }
 
+// Slots are indexed the same way in both modes, but only hashed tables
+// have empty ones.
+static usize slotCount(Table const *table) {
+    return IS_INLINE(table) ? table->count : table->capacity;
+}
+
+static Entry const *slotEntry(Table const *table, usize index) {
+    if (IS_INLINE(table)) { return &table->inlineEntries[index]; }
+    return IS_FULL(table->control[index]) ? &table->entries[index] : NULL;
+}
+
+// The entry must not already be in the table, which must have room for it
+static void insertEntry(Table *table, Entry entry) {
+    if (IS_INLINE(table)) {
+        table->inlineEntries[table->count++] = entry;
+        return;
+    }
+    usize const index = findEmptySlot(table->control, table->capacity, entry.key->hash);
+    setControl(table, index, HASH_TAG(entry.key->hash));
+    table->entries[index] = entry;
+    ++table->count;
+}
+
+// A capacity of 0 moves the entries inline
 static void adjustCapacity(Table *table, usize capacity) {
-    Entry *entries = ALLOCATE(Entry, capacity);
-    for (usize i = 0; i < capacity; ++i) {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
+    Table resized;  // NOLINT
+    initTable(&resized);
+    if (capacity != 0) {
+        resized.control = ALLOCATE(u8, capacity + GROUP_WIDTH);
+        resized.entries = ALLOCATE(Entry, capacity);
+        resized.capacity = capacity;
+        memset(resized.control, CONTROL_EMPTY, capacity + GROUP_WIDTH);
     }
-    table->count = 0;
-    for (usize i = 0; i < table->capacity; ++i) {
-        Entry *entry = &table->entries[i];
-        if (entry->key == NULL) {
-            continue;
+    for (usize i = 0; i < slotCount(table); ++i) {
+        Entry const *entry = slotEntry(table, i);
+        if (entry != NULL) { insertEntry(&resized, *entry); }
+    }
+    freeTable(table);
+    *table = resized;
+}
+
+static void growFor(Table *table, usize count) {
+    if (IS_INLINE(table)) {
+        if (count > TABLE_INLINE_CAPACITY) { adjustCapacity(table, GROUP_WIDTH); }
+    } else if ((float)count > (float)table->capacity * TABLE_MAX_LOAD) {
+        adjustCapacity(table, GROW_CAPACITY(table->capacity));
+    }
+}
+
+// Shrinks below TABLE_MIN_LOAD. Allocates, so it must not run while the
+// collector is sweeping.
+static void shrinkFor(Table *table, usize count) {
+    if (!IS_INLINE(table) && (float)count < (float)table->capacity * TABLE_MIN_LOAD) {
+        usize capacity = table->capacity / 2U;
+        while (capacity >= GROUP_WIDTH && (float)count < (float)capacity * TABLE_MIN_LOAD) { capacity /= 2U; }
+        // Below the smallest hashed size the entries go back inline
+        adjustCapacity(table, capacity < GROUP_WIDTH ? 0 : capacity);
+    }
+}
+
+// Empties `index`. Inline tables move their last entry into the hole. Hashed
+// tables shift later entries of the same run back into it, so deletion
+// leaves no tombstones behind.
+static void removeSlot(Table *table, usize index) {
+    --table->count;
+    if (IS_INLINE(table)) {
+        table->inlineEntries[index] = table->inlineEntries[table->count];
+        return;
+    }
+
+    usize const mask = table->capacity - 1U;
+    usize hole = index;
+    for (usize next = (hole + 1U) & mask; IS_FULL(table->control[next]); next = (next + 1U) & mask) {
+        usize const home = HASH_HOME(table->entries[next].key->hash) & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            table->entries[hole] = table->entries[next];
+            setControl(table, hole, table->control[next]);
+            hole = next;
         }
-        Entry *dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        ++table->count;
     }
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-    table->entries = entries;
-    table->capacity = capacity;
+    setControl(table, hole, CONTROL_EMPTY);
+}
+
+// Sized so that `count` entries fit without growing
+void initTableWithCapacity(Table *table, usize count) {
+    initTable(table);
+    if (count <= TABLE_INLINE_CAPACITY) { return; }
+    usize capacity = GROUP_WIDTH;
+    while ((float)count > (float)capacity * TABLE_MAX_LOAD) { capacity *= 2U; }
+    adjustCapacity(table, capacity);
 }
 
 void freeTable(Table *table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    if (!IS_INLINE(table)) {
+        FREE_ARRAY(u8, table->control, table->capacity + GROUP_WIDTH);
+        FREE_ARRAY(Entry, table->entries, table->capacity);
+    }
     initTable(table);
 }
 
 bool tableSet(Table *table, ObjString *key, Value value) {
-    if ((float)(table->count + 1U) > (float)table->capacity * TABLE_MAX_LOAD) {
-        usize const capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+    if (!key->isInterned) { key = internString(key); }
+    Entry *existing = findEntry(table, key);
+    if (existing != NULL) {
+        existing->value = value;
+        return false;
     }
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    bool const isNewKey = entry->key == NULL;
-    if (isNewKey && IS_NIL(entry->value)) { ++table->count; }
 
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+    growFor(table, table->count + 1U);
+    insertEntry(table, (Entry){.key = key, .value = value});
+    return true;
 }
 
 bool tableGet(Table *table, ObjString *key, Value *value) {
     if (table->count == 0) { return false; }
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) { return false; }
+    if (!key->isInterned && (key = findInterned(key)) == NULL) { return false; }  // NOLINT
+    Entry const *entry = findEntry(table, key);
+    if (entry == NULL) { return false; }
     *value = entry->value;
     return true;
 }
@@ -82,51 +234,149 @@ bool tableGet(Table *table, ObjString *key, Value *value) {
 
 bool tableDelete(Table *table, ObjString *key) {
     if (table->count == 0) { return false; }
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) { return false; }
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    if (!key->isInterned && (key = findInterned(key)) == NULL) { return false; }  // NOLINT
+    Entry *entry = findEntry(table, key);
+    if (entry == NULL) { return false; }
+    removeSlot(table, (usize)(entry - (IS_INLINE(table) ? table->inlineEntries : table->entries)));
+    shrinkFor(table, table->count);
     return true;
 }
 
-void tableAddAll(const Table *from, Table *to) {
-    for (usize i = 0; i < from->capacity; ++i) {
-        Entry *entry = &from->entries[i];
-        if (entry->key != NULL) {
-            tableSet(to, entry->key, entry->value);
-        }
+void tableCompact(Table *table) {
+    shrinkFor(table, table->count);
+}
+
+void tableAddAll(Table const *from, Table *to) {
+    for (usize i = 0; i < slotCount(from); ++i) {
+        Entry const *entry = slotEntry(from, i);
+        if (entry != NULL) { tableSet(to, entry->key, entry->value); }
     }
 }
 
+static bool keyEquals(ObjString const *key, const char *chars, usize length, u32 hash) {
+    return key->length == length && key->hash == hash && memcmp(key->chars, chars, length) == 0;
+}
+
 ObjString *tableFindString(Table *table, const char *chars, usize length, u32 hash) {
     if (table->count == 0) { return NULL; }
+    if (IS_INLINE(table)) {
+        for (usize i = 0; i < table->count; ++i) {
+            ObjString *key = table->inlineEntries[i].key;
+            if (keyEquals(key, chars, length, hash)) { return key; }
+        }
+        return NULL;
+    }
 
-    usize index = hash % table->capacity;
-    while (true) {
-        Entry *entry = &table->entries[index];
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) { return NULL; }
-        } else if (entry->key->length == length
-                   && entry->key->hash == hash
-                   && memcmp(entry->key->chars, chars, length) == 0) {
-            return entry->key;
+    usize const mask = table->capacity - 1U;
+    u8 const tag = HASH_TAG(hash);
+    for (usize group = HASH_HOME(hash) & mask;; group = (group + GROUP_WIDTH) & mask) {
+        Group const controls = loadGroup(table->control + group);
+        for (u32 matches = matchTag(controls, tag); matches != 0; matches &= matches - 1U) {
+            ObjString *key = table->entries[(group + lowestBit(matches)) & mask].key;
+            if (keyEquals(key, chars, length, hash)) { return key; }
         }
-        index = (index + 1U) & (table->capacity - 1U);
+        if (matchEmpty(controls) != 0) { return NULL; }
     }
 }
 
+// Runs during collection, so the table is only shrunk by tableCompact
 void tableRemoveWhite(Table *table) {
-    for (usize i = 0; i < table->capacity; ++i) {
-        Entry *entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
-            tableDelete(table, entry->key);
+    for (usize i = 0; i < slotCount(table);) {
+        Entry const *entry = slotEntry(table, i);
+        if (entry != NULL && !entry->key->obj.isMarked) {
+            // Look at `i` again, a later entry may have been moved into it
+            removeSlot(table, i);
+        } else {
+            ++i;
         }
     }
 }
 
 void markTable(Table *table) {
+    for (usize i = 0; i < slotCount(table); ++i) {
+        Entry const *entry = slotEntry(table, i);
+        if (entry == NULL) { continue; }
+        markObject((Obj *)entry->key);
+        markValue(entry->value);
+    }
+}
+
+#define SEAL_MULTIPLIER 0x9E3779B1U
+#define SEAL_SEEDS 256U
+#define SEAL_MAX_SPREAD 3U
+
+static usize sealedSlot(u32 hash, u32 seed, u32 shift) {
+    return (usize)(((hash ^ seed) * SEAL_MULTIPLIER) >> shift);
+}
+
+void initSealedTable(SealedTable *table) {
+    table->capacity = 0;
+    table->seed = 0;
+    table->shift = 0;
+    table->entries = NULL;
+}
+
+void freeSealedTable(SealedTable *table) {
+    FREE_ARRAY(Entry, table->entries, table->capacity);
+    initSealedTable(table);
+}
+
+static bool trySeed(Table *from, Entry *entries, usize capacity, u32 seed, u32 shift) {
+    for (usize i = 0; i < capacity; ++i) { entries[i].key = NULL; }
+    for (usize i = 0; i < slotCount(from); ++i) {
+        Entry const *entry = slotEntry(from, i);
+        if (entry == NULL) { continue; }
+        Entry *slot = &entries[sealedSlot(entry->key->hash, seed, shift)];
+        if (slot->key != NULL) { return false; }
+        *slot = *entry;
+    }
+    return true;
+}
+
+// Searches for a seed that sends every key to its own slot, trying up to
+// 2^SEAL_MAX_SPREAD times more slots than keys. Fails, leaving `to` empty,
+// when none is found; keys with equal hashes can never be separated.
+bool sealTable(Table *from, SealedTable *to) {
+    initSealedTable(to);
+    if (from->count == 0) { return true; }
+
+    u32 bits = 1;
+    while (((usize)1U << bits) < from->count) { ++bits; }
+    for (u32 const maxBits = bits + SEAL_MAX_SPREAD; bits <= maxBits; ++bits) {
+        usize const capacity = (usize)1U << bits;
+        Entry *entries = ALLOCATE(Entry, capacity);
+        u32 const shift = 32U - bits;
+        for (u32 seed = 0; seed < SEAL_SEEDS; ++seed) {
+            if (trySeed(from, entries, capacity, seed, shift)) {
+                *to = (SealedTable){.capacity = capacity, .seed = seed, .shift = shift, .entries = entries};
+                return true;
+            }
+        }
+        FREE_ARRAY(Entry, entries, capacity);
+    }
+    return false;
+}
+
+bool sealedTableGet(SealedTable const *table, ObjString *key, Value *value) {
+    if (table->capacity == 0) { return false; }
+    if (!key->isInterned && (key = findInterned(key)) == NULL) { return false; }  // NOLINT
+    Entry const *entry = &table->entries[sealedSlot(key->hash, table->seed, table->shift)];
+    if (entry->key != key) { return false; }
+    *value = entry->value;
+    return true;
+}
+
+void sealedTableAddAll(SealedTable const *from, Table *to) {
+    for (usize i = 0; i < from->capacity; ++i) {
+        Entry const *entry = &from->entries[i];
+        if (entry->key != NULL) { tableSet(to, entry->key, entry->value); }
+    }
+}
+
+void markSealedTable(SealedTable *table) {
     for (usize i = 0; i < table->capacity; ++i) {
-        Entry *entry = &table->entries[i];
+        Entry const *entry = &table->entries[i];
+        if (entry->key == NULL) { continue; }
         markObject((Obj *)entry->key);
         markValue(entry->value);
     }
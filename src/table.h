@@ -9,20 +9,53 @@ typedef struct {
     Value value;
 } Entry;
 
+#define TABLE_INLINE_CAPACITY 6U
+
+// Up to TABLE_INLINE_CAPACITY entries are kept unhashed in `inlineEntries`
+// and found by comparing key pointers; capacity is 0 in that mode.
+//
+// Larger tables use a Swiss-table layout: `control` holds one byte per slot,
+// either empty or the low 7 bits of the key's hash, and is probed a group
+// of slots at a time. The first group is cloned past the end of the array so
+// a group can be loaded at any slot without wrapping.
 typedef struct {
     usize count;
     usize capacity;
-    Entry *entries;
+    union {
+        struct {
+            u8 *control;
+            Entry *entries;
+        };
+        Entry inlineEntries[TABLE_INLINE_CAPACITY];
+    };
 } Table;
 
+// Read-only table with a slot of its own for every key, so a lookup is a
+// single probe. Built once by sealTable.
+typedef struct {
+    usize capacity;
+    u32 seed;
+    u32 shift;
+    Entry *entries;
+} SealedTable;
+
 void initTable(Table *table);
+void initTableWithCapacity(Table *table, usize count);
 void freeTable(Table *table);
 bool tableSet(Table *table, ObjString *key, Value value);
 bool tableGet(Table *table, ObjString *key, Value *value);
 bool tableDelete(Table *table, ObjString *key);
+void tableCompact(Table *table);
 void tableAddAll(Table const *from, Table *to);
 ObjString *tableFindString(Table *table, const char *chars, usize length, u32 hash);
 void tableRemoveWhite(Table *);
 void markTable(Table *table);
 
+void initSealedTable(SealedTable *table);
+void freeSealedTable(SealedTable *table);
+bool sealTable(Table *from, SealedTable *to);
+bool sealedTableGet(SealedTable const *table, ObjString *key, Value *value);
+void sealedTableAddAll(SealedTable const *from, Table *to);
+void markSealedTable(SealedTable *table);
+
 #endif
@@ -29,10 +29,11 @@ void freeValueArray(ValueArray *array) {
 void printValue(Value value) {
 #ifdef NAN_BOXING
     if (IS_BOOL(value)) {
-        printf(AS_BOOL(value) ? "true" : "fale");
+        printf(AS_BOOL(value) ? "true" : "false");
     } else if (IS_NIL(value)) {
         printf("nil");
     } else if (IS_NUMBER(value)) {
+        // Ints print like the doubles they stand for
         printf("%g", AS_NUMBER(value));
     } else if (IS_OBJ(value)) {
         printObject(value);
@@ -46,6 +47,7 @@ void printValue(Value value) {
         printf("nil");
         break;
     case VAL_NUMBER:
+    case VAL_INT:
         printf("%g", AS_NUMBER(value));
         break;
     case VAL_OBJ:
@@ -57,14 +59,23 @@ void printValue(Value value) {
 
 bool valuesEqual(Value a, Value b) {
 #ifdef NAN_BOXING
+    if (IS_INT(a) && IS_INT(b)) { return a == b; }
     if (IS_NUMBER(a) && IS_NUMBER(b)) {
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wfloat-equal"
         return AS_NUMBER(a) == AS_NUMBER(b);
 #pragma GCC diagnostic pop
     }
+    if (IS_OBJ(a) && IS_OBJ(b)) { return objectsEqual(AS_OBJ(a), AS_OBJ(b)); }
     return a == b;
 #else
+    if (IS_INT(a) && IS_INT(b)) { return AS_INT(a) == AS_INT(b); }
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wfloat-equal"
+        return AS_NUMBER(a) == AS_NUMBER(b);
+#pragma GCC diagnostic pop
+    }
     if (a.type != b.type) { return false; }
     switch (a.type) {
     case VAL_BOOL:
@@ -72,14 +83,30 @@ bool valuesEqual(Value a, Value b) {
     case VAL_NIL:
         return true;
     case VAL_NUMBER:
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wfloat-equal"
-        return AS_NUMBER(a) == AS_NUMBER(b);
-#pragma GCC diagnostic pop
+    case VAL_INT:
+        return false;  // Pairs of numbers are compared above
     case VAL_OBJ: {
-        return AS_OBJ(a) == AS_OBJ(b);
+        return objectsEqual(AS_OBJ(a), AS_OBJ(b));
     }
     }
     __builtin_unreachable();
 #endif
 }
+
+// Whether `value` is a whole number usable as an index
+bool toIndex(Value value, usize *index) {
+    if (IS_INT(value)) {
+        i64 const integer = AS_INT(value);
+        if (integer < 0 || integer > (i64)UINT32_MAX) { return false; }
+        *index = (usize)integer;
+        return true;
+    }
+    if (!IS_NUMBER(value)) { return false; }
+    double const number = AS_NUMBER(value);
+    if (number < 0.0 || number > (double)UINT32_MAX) { return false; }
+    *index = (usize)number;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wfloat-equal"
+    return (double)*index == number;
+#pragma GCC diagnostic pop
+}
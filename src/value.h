@@ -7,6 +7,17 @@
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+// Integers are limited to 48 bits so that they fit in a NaN payload. Results
+// outside this range fall back to doubles.
+// NOLINTNEXTLINE
+#define SMALL_INT_MAX (((i64)1 << 47) - 1)
+// NOLINTNEXTLINE
+#define SMALL_INT_MIN (-((i64)1 << 47))
+
+static inline bool fitsSmallInt(i64 integer) {
+    return integer >= SMALL_INT_MIN && integer <= SMALL_INT_MAX;
+}
+
 #ifdef NAN_BOXING
 
 // NOLINTNEXTLINE
@@ -22,6 +33,12 @@ typedef struct ObjString ObjString;
 // NOLINTNEXTLINE
 #define TAG_TRUE 3  // 11.
 
+// Integers set bit 49 and keep their two's complement in the low 48 bits
+// NOLINTNEXTLINE
+#define TAG_INT ((u64)0x0002000000000000)
+// NOLINTNEXTLINE
+#define INT_PAYLOAD ((u64)0x0000FFFFFFFFFFFF)
+
 typedef u64 Value;
 
 // NOLINTNEXTLINE
@@ -31,7 +48,14 @@ typedef u64 Value;
 #define IS_NIL(value) ((value) == NIL_VAL)
 
 // NOLINTNEXTLINE
-#define IS_NUMBER(value) (((value)&QNAN) != QNAN)
+#define IS_DOUBLE(value) (((value)&QNAN) != QNAN)
+
+// NOLINTNEXTLINE
+#define IS_INT(value) \
+    (((value) & (SIGN_BIT | QNAN | TAG_INT)) == (QNAN | TAG_INT))
+
+// NOLINTNEXTLINE
+#define IS_NUMBER(value) (IS_DOUBLE(value) || IS_INT(value))
 
 // NOLINTNEXTLINE
 #define IS_OBJ(value) \
@@ -44,6 +68,9 @@ typedef u64 Value;
 // NOLINTNEXTLINE
 #define AS_NUMBER(value) valueToNum(value)
 
+// NOLINTNEXTLINE
+#define AS_INT(value) valueToInt(value)
+
 // NOLINTNEXTLINE
 #define AS_OBJ(value) \
     ((Obj *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
@@ -62,11 +89,32 @@ typedef u64 Value;
 // NOLINTNEXTLINE
 #define NUMBER_VAL(num) numToValue(num)
 
+// NOLINTNEXTLINE
+#define INT_VAL(integer) intToValue(integer)
+
 // NOLINTNEXTLINE
 #define OBJ_VAL(obj) \
     (Value)(SIGN_BIT | QNAN | (u64)(uintptr_t)(obj))
 
+static inline i64 valueToInt(Value value) {
+    return (i64)(value << 16U) >> 16U;
+}
+
+static inline Value intToValue(i64 integer) {
+    return (Value)(QNAN | TAG_INT | ((u64)integer & INT_PAYLOAD));
+}
+
+// Ints shifted into the top 48 bits, where i64 overflow is exactly int overflow
+static inline i64 valueToScaledInt(Value value) {
+    return (i64)(value << 16U);
+}
+
+static inline Value scaledIntToValue(i64 scaled) {
+    return (Value)(QNAN | TAG_INT | ((u64)scaled >> 16U));
+}
+
 static inline double valueToNum(Value value) {
+    if (IS_INT(value)) { return (double)valueToInt(value); }
     double num;  // NOLINT
     memcpy(&num, &value, sizeof(Value));
     return num;
@@ -84,6 +132,7 @@ typedef enum {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
+    VAL_INT,
     VAL_OBJ,
 } ValueType;
 
@@ -92,6 +141,7 @@ typedef struct {
     union {
         bool boolean;
         double number;
+        i64 integer;
         Obj *obj;
     } as;
 } Value;
@@ -102,14 +152,20 @@ typedef struct {
 // NOLINTNEXTLINE
 #define IS_NIL(value) ((value).type == VAL_NIL)
 // NOLINTNEXTLINE
-#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#define IS_DOUBLE(value) ((value).type == VAL_NUMBER)
+// NOLINTNEXTLINE
+#define IS_INT(value) ((value).type == VAL_INT)
+// NOLINTNEXTLINE
+#define IS_NUMBER(value) (IS_DOUBLE(value) || IS_INT(value))
 // NOLINTNEXTLINE
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
 // NOLINTNEXTLINE
 #define AS_BOOL(value) ((value).as.boolean)
 // NOLINTNEXTLINE
-#define AS_NUMBER(value) ((value).as.number)
+#define AS_NUMBER(value) valueToNum(value)
+// NOLINTNEXTLINE
+#define AS_INT(value) ((value).as.integer)
 // NOLINTNEXTLINE
 #define AS_OBJ(value) ((value).as.obj)
 
@@ -121,8 +177,22 @@ typedef struct {
 // NOLINTNEXTLINE
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = (value)}})
 // NOLINTNEXTLINE
+#define INT_VAL(value) ((Value){VAL_INT, {.integer = (value)}})
+// NOLINTNEXTLINE
 #define OBJ_VAL(value) ((Value){VAL_OBJ, {.obj = (Obj *)(value)}})
 
+static inline i64 valueToScaledInt(Value value) {
+    return (i64)((u64)AS_INT(value) << 16U);
+}
+
+static inline Value scaledIntToValue(i64 scaled) {
+    return INT_VAL(scaled >> 16U);
+}
+
+static inline double valueToNum(Value value) {
+    return IS_INT(value) ? (double)AS_INT(value) : value.as.number;
+}
+
 #endif
 
 typedef struct {
@@ -132,6 +202,7 @@ typedef struct {
 } ValueArray;
 
 bool valuesEqual(Value a, Value b);
+bool toIndex(Value value, usize *index);
 void initValueArray(ValueArray *array);
 void writeValueArray(ValueArray *array, Value value);
 void freeValueArray(ValueArray *array);
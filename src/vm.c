@@ -4,29 +4,26 @@
 #include "compiler.h"
 #include "debug.h"
 #include "memory.h"
+#include "natives.h"
 #include "object.h"
 #include "stdarg.h"
 #include "stdio.h"
 #include "table.h"
 #include "value.h"
 #include <string.h>
-#include <time.h>
 
 VM vm;  // NOLINT
 
-static Value clockNative(int argCount, Value *args) {
-    (void)args;
-    (void)argCount;
-    return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
-}
-
 static void resetStack(void) {
+    for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        vm.openUpvalueSlots[upvalue->location - vm.stack] = NULL;
+    }
     vm.stackTop = vm.stack;
     vm.frameCount = 0;
     vm.openUpvalues = NULL;
 }
 
-static void runtimeError(const char *format, ...) {
+void runtimeError(const char *format, ...) {
     va_list args;
     va_start(args, format);
     (void)vfprintf(stderr, format, args);  // NOLINT
@@ -37,7 +34,13 @@ static void runtimeError(const char *format, ...) {
         CallFrame *frame = &vm.frames[i];
         ObjFunction *function = frame->closure->function;
         usize const instruction = (usize)(frame->ip - function->chunk.code - 1U);
-        (void)fprintf(stderr, "[line %zu] in ", function->chunk.lines[instruction]);
+        usize line = function->chunk.lines[instruction];
+        InlinedCode const *inlined = findInlinedCode(&function->chunk, instruction);
+        if (inlined != NULL) {
+            (void)fprintf(stderr, "[line %zu] in %s()\n", line, inlined->name->chars);
+            line = inlined->line;
+        }
+        (void)fprintf(stderr, "[line %zu] in ", line);
         if (function->name == NULL) {
             (void)fprintf(stderr, "script\n");
         } else {
@@ -48,9 +51,9 @@ static void runtimeError(const char *format, ...) {
     resetStack();
 }
 
-static void defineNative(const char *name, NativeFn function) {
+void defineNative(const char *name, i32 arity, NativeFn function) {
     push(OBJ_VAL(copyString(name, strlen(name))));
-    push(OBJ_VAL(newNative(function)));
+    push(OBJ_VAL(newNative(function, arity)));
     tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
     pop();
     pop();
@@ -60,12 +63,18 @@ static Value peek(i32 distance) {
     return vm.stackTop[-1 - distance];
 }
 
+// Leaves a frame's worth of temporaries above the function's locals
+static bool hasRoomFor(ObjFunction const *function) {
+    return vm.frameCount < FRAMES_MAX
+           && (usize)(vm.stackTop - vm.stack) + function->slotCount + UINT8_COUNT <= STACK_MAX;
+}
+
 static bool call(ObjClosure *closure, i32 argCount) {
     if ((usize)argCount != closure->function->arity) {
         runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
         return false;
     }
-    if (vm.frameCount == FRAMES_MAX) {
+    if (!hasRoomFor(closure->function)) {
         runtimeError("Stack overflow.");
         return false;
     }
@@ -76,14 +85,22 @@ static bool call(ObjClosure *closure, i32 argCount) {
     return true;
 }
 
+static bool findMethod(ObjClass *klass, ObjString *name, Value *method) {
+    if (klass->isSealed) { return sealedTableGet(&klass->sealedMethods, name, method); }
+    return tableGet(&klass->methods, name, method);
+}
+
 static bool callValue(Value callee, i32 argCount) {
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee)) {
         case OBJ_NATIVE: {
-            NativeFn native = AS_NATIVE(callee);
-            Value const result = native(argCount, vm.stackTop - argCount);
-            vm.stackTop -= argCount + 1;
-            push(result);
+            ObjNative const *native = AS_NATIVE(callee);
+            if (native->arity != -1 && argCount != native->arity) {
+                runtimeError("Expected %d arguments but got %d.", native->arity, argCount);
+                return false;
+            }
+            if (!native->function(argCount, vm.stackTop - argCount)) { return false; }
+            vm.stackTop -= argCount;
             return true;
         }
         case OBJ_CLOSURE:
@@ -91,9 +108,8 @@ static bool callValue(Value callee, i32 argCount) {
         case OBJ_CLASS: {
             ObjClass *klass = AS_CLASS(callee);
             vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
-            Value initializer;
-            if (tableGet(&klass->methods, vm.initString, &initializer)) {
-                return call(AS_CLOSURE(initializer), argCount);
+            if (klass->initializer != NULL) {
+                return call(klass->initializer, argCount);
             } else if (argCount != 0) {
                 runtimeError("Expected 0 arguments but got %d", argCount);
                 return false;
@@ -115,7 +131,7 @@ static bool callValue(Value callee, i32 argCount) {
 
 static bool invokeFromClass(ObjClass *klass, ObjString *name, i32 argCount) {
     Value method;
-    if (!tableGet(&klass->methods, name, &method)) {
+    if (!findMethod(klass, name, &method)) {
         runtimeError("Undefined property '%s'.", name->chars);
         return false;
     }
@@ -139,7 +155,7 @@ static bool invoke(ObjString *name, i32 argCount) {
 
 static bool bindMethod(ObjClass *klass, ObjString *name) {
     Value method;
-    if (!tableGet(&klass->methods, name, &method)) {
+    if (!findMethod(klass, name, &method)) {
         runtimeError("Undefined property '%s'.", name->chars);
         return false;
     }
@@ -150,31 +166,37 @@ static bool bindMethod(ObjClass *klass, ObjString *name) {
 }
 
 static ObjUpvalue *captureUpvalue(Value *local) {
-    ObjUpvalue *prevUpvalue = NULL;
-    ObjUpvalue *upvalue = vm.openUpvalues;
-    while (upvalue != NULL && upvalue->location > local) {
-        prevUpvalue = upvalue;
-        upvalue = upvalue->next;
-    }
-    if (upvalue != NULL && upvalue->location == local) {
-        return upvalue;
-    }
+    ObjUpvalue **slot = &vm.openUpvalueSlots[local - vm.stack];
+    if (*slot != NULL) { return *slot; }
+
     ObjUpvalue *createdUpvalue = newUpvalue(local);
-    createdUpvalue->next = upvalue;
-    if (prevUpvalue == NULL) {
-        vm.openUpvalues = createdUpvalue;
+    createdUpvalue->next = vm.openUpvalues;
+    if (vm.openUpvalues != NULL) { vm.openUpvalues->prev = createdUpvalue; }
+    vm.openUpvalues = createdUpvalue;
+    *slot = createdUpvalue;
+    return createdUpvalue;
+}
+
+static void closeUpvalue(ObjUpvalue *upvalue) {
+    vm.openUpvalueSlots[upvalue->location - vm.stack] = NULL;
+    upvalue->closed = *upvalue->location;
+    upvalue->location = &upvalue->closed;
+
+    if (upvalue->prev != NULL) {
+        upvalue->prev->next = upvalue->next;
     } else {
-        prevUpvalue->next = createdUpvalue;
+        vm.openUpvalues = upvalue->next;
     }
-    return createdUpvalue;
+    if (upvalue->next != NULL) { upvalue->next->prev = upvalue->prev; }
+    upvalue->next = NULL;
+    upvalue->prev = NULL;
 }
 
+// Only the running frame can capture its slots, so the open upvalues of the
+// current frame always sit at the head of the list, before any older frame's.
 static void closeUpvalues(Value *last) {
     while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
-        ObjUpvalue *upvalue = vm.openUpvalues;
-        upvalue->closed = *upvalue->location;
-        upvalue->location = &upvalue->closed;
-        vm.openUpvalues = upvalue->next;
+        closeUpvalue(vm.openUpvalues);
     }
 }
 
@@ -185,26 +207,321 @@ static void defineMethod(ObjString *name) {
     pop();
 }
 
+// The class body has run, no more methods will be added
+static void sealClass(ObjClass *klass) {
+    if (sealTable(&klass->methods, &klass->sealedMethods)) {
+        freeTable(&klass->methods);
+        klass->isSealed = true;
+    }
+    Value initializer;
+    if (findMethod(klass, vm.initString, &initializer)) { klass->initializer = AS_CLOSURE(initializer); }
+}
+
+static void makeList(u8 count) {
+    ObjList *list = newList();
+    push(OBJ_VAL(list));
+    Value const *items = vm.stackTop - 1 - count;
+    for (u8 i = 0; i < count; ++i) { writeValueArray(&list->items, items[i]); }
+    vm.stackTop -= count + 1;
+    push(OBJ_VAL(list));
+}
+
+static bool makeMap(u8 count) {
+    ObjMap *map = newMap();
+    push(OBJ_VAL(map));
+    Value *pairs = vm.stackTop - 1 - 2 * count;
+    for (u8 i = 0; i < count; ++i) {
+        Value *key = &pairs[2 * i];
+        if (!isMapKey(*key)) {
+            runtimeError("Map keys can't be nil or NaN.");
+            return false;
+        }
+        *key = mapKey(*key);  // Keep the interned key on the stack
+        mapSet(&map->entries, *key, key[1]);
+    }
+    vm.stackTop -= 2 * count + 1;
+    push(OBJ_VAL(map));
+    return true;
+}
+
+static bool checkArrayIndex(usize length, Value index, usize *position) {
+    if (!toIndex(index, position) || *position >= length) {
+        runtimeError("Index out of range.");
+        return false;
+    }
+    return true;
+}
+
+// [container, index] -> [element]
+static bool getIndex(void) {
+    Value const container = peek(1);
+    if (IS_LIST(container)) {
+        ObjList const *list = AS_LIST(container);
+        usize position;  // NOLINT
+        if (!checkArrayIndex(list->items.count, peek(0), &position)) { return false; }
+        vm.stackTop -= 2;
+        push(list->items.values[position]);
+        return true;
+    }
+    if (IS_F64_ARRAY(container)) {
+        ObjF64Array const *array = AS_F64_ARRAY(container);
+        usize position;  // NOLINT
+        if (!checkArrayIndex(array->length, peek(0), &position)) { return false; }
+        vm.stackTop -= 2;
+        push(NUMBER_VAL(array->values[position]));
+        return true;
+    }
+    if (IS_BYTES(container)) {
+        ObjBytes const *bytes = AS_BYTES(container);
+        usize position;  // NOLINT
+        if (!checkArrayIndex(bytes->length, peek(0), &position)) { return false; }
+        vm.stackTop -= 2;
+        push(INT_VAL(bytes->data[position]));
+        return true;
+    }
+    if (IS_MAP(container)) {
+        // Missing keys read as nil
+        Value value = NIL_VAL;
+        mapGet(&AS_MAP(container)->entries, peek(0), &value);
+        vm.stackTop -= 2;
+        push(value);
+        return true;
+    }
+    runtimeError("Only lists, maps and arrays can be indexed.");
+    return false;
+}
+
+// [container, index, value] -> [value]
+static bool setIndex(void) {
+    Value const container = peek(2);
+    if (IS_LIST(container)) {
+        ObjList *list = AS_LIST(container);
+        usize position;  // NOLINT
+        if (!checkArrayIndex(list->items.count, peek(1), &position)) { return false; }
+        Value const value = peek(0);
+        list->items.values[position] = value;
+        vm.stackTop -= 3;
+        push(value);
+        return true;
+    }
+    if (IS_F64_ARRAY(container)) {
+        ObjF64Array *array = AS_F64_ARRAY(container);
+        usize position;  // NOLINT
+        if (!checkArrayIndex(array->length, peek(1), &position)) { return false; }
+        if (!IS_NUMBER(peek(0))) {
+            runtimeError("F64 array elements must be numbers.");
+            return false;
+        }
+        array->values[position] = AS_NUMBER(peek(0));
+        Value const value = peek(0);
+        vm.stackTop -= 3;
+        push(value);
+        return true;
+    }
+    if (IS_BYTES(container)) {
+        ObjBytes *bytes = AS_BYTES(container);
+        usize position;  // NOLINT
+        usize byte;  // NOLINT
+        if (!checkArrayIndex(bytes->length, peek(1), &position)) { return false; }
+        if (!toIndex(peek(0), &byte) || byte > UINT8_MAX) {
+            runtimeError("Bytes must be integers from 0 to 255.");
+            return false;
+        }
+        bytes->data[position] = (u8)byte;
+        Value const value = peek(0);
+        vm.stackTop -= 3;
+        push(value);
+        return true;
+    }
+    if (IS_MAP(container)) {
+        if (!isMapKey(peek(1))) {
+            runtimeError("Map keys can't be nil or NaN.");
+            return false;
+        }
+        vm.stackTop[-2] = mapKey(peek(1));  // Keep the interned key on the stack
+        Value const value = peek(0);
+        mapSet(&AS_MAP(container)->entries, peek(1), value);
+        vm.stackTop -= 3;
+        push(value);
+        return true;
+    }
+    runtimeError("Only lists, maps and arrays can be indexed.");
+    return false;
+}
+
+// Advances the iteration over iterator[0] whose state is in iterator[1]:
+// nil before the first step, then the last value of a range or the next
+// index. Pushes the next element or sets `done`.
+static bool nextElement(Value *iterator, bool *done) {
+    Value const sequence = iterator[0];
+    if (IS_RANGE(sequence)) {
+        ObjRange const *range = AS_RANGE(sequence);
+        i64 const next = IS_NIL(iterator[1]) ? range->start : AS_INT(iterator[1]) + range->step;
+        if (range->step > 0 ? next >= range->end : next <= range->end) {
+            *done = true;
+            return true;
+        }
+        iterator[1] = INT_VAL(next);
+        push(iterator[1]);
+        return true;
+    }
+    usize index = IS_NIL(iterator[1]) ? 0U : (usize)AS_INT(iterator[1]);
+    Value element;  // NOLINT
+    if (IS_LIST(sequence)) {
+        ValueArray const *items = &AS_LIST(sequence)->items;
+        *done = index >= items->count;
+        if (!*done) { element = items->values[index]; }
+    } else if (IS_F64_ARRAY(sequence)) {
+        ObjF64Array const *array = AS_F64_ARRAY(sequence);
+        *done = index >= array->length;
+        if (!*done) { element = NUMBER_VAL(array->values[index]); }
+    } else if (IS_BYTES(sequence)) {
+        ObjBytes const *bytes = AS_BYTES(sequence);
+        *done = index >= bytes->length;
+        if (!*done) { element = INT_VAL(bytes->data[index]); }
+    } else if (IS_ANY_STRING(sequence)) {
+        *done = index >= stringLength(AS_OBJ(sequence));
+        if (!*done) { element = OBJ_VAL(copyString(stringChars(AS_OBJ(sequence)) + index, 1)); }
+    } else if (IS_MAP(sequence)) {
+        // Maps yield their keys in slot order
+        Map const *map = &AS_MAP(sequence)->entries;
+        while (index < map->capacity && IS_NIL(map->entries[index].key)) { ++index; }
+        *done = index >= map->capacity;
+        if (!*done) { element = map->entries[index].key; }
+    } else {
+        runtimeError("Can only iterate over ranges, lists, maps, arrays, strings and instances with next().");
+        return false;
+    }
+    if (*done) { return true; }
+    iterator[1] = INT_VAL((i64)index + 1);
+    push(element);
+    return true;
+}
+
 static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
 static void concatenate(void) {
-    ObjString const *b = AS_STRING(peek(0));
-    ObjString const *a = AS_STRING(peek(1));
-
-    usize const length = a->length + b->length;
-    char *chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
-
-    ObjString *result = takeString(chars, length);
+    Obj *result = concatenateStrings(AS_OBJ(peek(1)), AS_OBJ(peek(0)));
     pop();
     pop();
     push(OBJ_VAL(result));
 }
 
+static bool getGlobal(ObjString *name) {
+    Value value;  // NOLINT
+    if (!tableGet(&vm.globals, name, &value)) {
+        runtimeError("Undefined variable '%s'.", name->chars);
+        return false;
+    }
+    push(value);
+    return true;
+}
+
+static void defineGlobal(ObjString *name) {
+    tableSet(&vm.globals, name, peek(0));
+    pop();
+}
+
+static bool setGlobal(ObjString *name) {
+    if (tableSet(&vm.globals, name, peek(0))) {
+        tableDelete(&vm.globals, name);
+        runtimeError("Undefined variable '%s'.", name->chars);
+        return false;
+    }
+    return true;
+}
+
+static bool getProperty(ObjString *name) {
+    if (!IS_INSTANCE(peek(0))) {
+        runtimeError("Only instances have properties.");
+        return false;
+    }
+    ObjInstance *instance = AS_INSTANCE(peek(0));
+    Value value;  // NOLINT
+    if (tableGet(&instance->fields, name, &value)) {
+        pop();  // instance
+        push(value);
+        return true;
+    }
+    return bindMethod(instance->klass, name);
+}
+
+static bool setProperty(ObjString *name) {
+    if (!IS_INSTANCE(peek(1))) {
+        runtimeError("Only instances have fields.");
+        return false;
+    }
+    /* stack index 0->N from top to bottom
+     * <value to assign> -> index = 0
+     *  <instance field name> -> index = 1
+     * */
+    ObjInstance *instance = AS_INSTANCE(peek(1));
+    if (tableSet(&instance->fields, name, peek(0))
+        && instance->fields.count > instance->klass->fieldCountHint) {
+        instance->klass->fieldCountHint = instance->fields.count;
+    }
+    Value const value = pop();  // remove value from stack
+    pop();  // remove instance from stack
+    push(value);  // put value back into the stack (OP_SET_PROPERTY is an expression)
+    return true;
+}
+
+static bool superInvoke(ObjString *method, i32 argCount) {
+    ObjClass *superclass = AS_CLASS(pop());
+    return invokeFromClass(superclass, method, argCount);
+}
+
+static bool getSuper(ObjString *name) {
+    ObjClass *superclass = AS_CLASS(pop());
+    return bindMethod(superclass, name);
+}
+
+// Reads the (flags, index) pairs that follow the function's OP_CLOSURE
+static void pushClosure(CallFrame *frame, ObjFunction *function, bool isWide) {
+    if (function->upvalueCount == 0) {
+        if (function->closure == NULL) { function->closure = newClosure(function); }
+        push(OBJ_VAL(function->closure));
+        return;
+    }
+    ObjClosure *closure = newClosure(function);
+    push(OBJ_VAL(closure));
+    for (usize i = 0; i < closure->upvalueCount; ++i) {
+        u8 const flags = *frame->ip++;
+        usize index = *frame->ip++;
+        if (isWide) { index = index << 8U | *frame->ip++; }
+        if (!(flags & UPVALUE_LOCAL)) {
+            closure->upvalues[i] = frame->closure->upvalues[index];
+        } else if (flags & UPVALUE_BY_VALUE) {
+            closure->upvalues[i] = frame->slots[index];
+        } else {
+            closure->upvalues[i] = OBJ_VAL(captureUpvalue(frame->slots + index));
+        }
+    }
+}
+
+// Advances the for-in loop whose sequence is in iterator[0] and state in
+// iterator[1]. `instruction` is the OP_FOR_ITER that does it.
+static bool iterate(CallFrame *frame, u8 *instruction, Value *iterator, bool *done) {
+    *done = false;
+    if (!IS_INSTANCE(iterator[0])) { return nextElement(iterator, done); }
+    // next() returns to this instruction, which then finds true in the
+    // state and the result on the stack. nil ends the loop.
+    if (IS_NIL(iterator[1])) {
+        iterator[1] = BOOL_VAL(true);
+        frame->ip = instruction;
+        push(iterator[0]);
+        return invoke(vm.nextString, 0);
+    }
+    iterator[1] = NIL_VAL;
+    if (IS_NIL(peek(0))) {
+        pop();
+        *done = true;
+    }
+    return true;
+}
+
 // NOLINTNEXTLINE(readability-function-cognitive-complexity)
 static InterpretResult run(void) {
     CallFrame *frame = &vm.frames[vm.frameCount - 1];
@@ -214,6 +531,10 @@ static InterpretResult run(void) {
 #define READ_SHORT() \
     (frame->ip += 2U, (u16)((u16)(frame->ip[-2] << 8U) | frame->ip[-1]))
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_LONG() \
+    (frame->ip += 4U, (u32)frame->ip[-4] << 24U | (u32)frame->ip[-3] << 16U | (u32)frame->ip[-2] << 8U | frame->ip[-1])
+#define READ_WIDE_CONSTANT() (frame->closure->function->chunk.constants.values[READ_SHORT()])
+#define READ_WIDE_STRING() AS_STRING(READ_WIDE_CONSTANT())
 #define BINARY_OP(valueType, op)                          \
     do {                                                  \
         if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
@@ -224,6 +545,24 @@ static InterpretResult run(void) {
         double const a = AS_NUMBER(pop());                \
         push(valueType(a op b));                          \
     } while (false)
+// Integer fast path: true when both operands are ints and `builtin` does not
+// overflow. Scaling the left operand up by 16 bits makes i64 overflow match
+// the int range.
+#define INT_BINARY_OP(builtin, right, result)                         \
+    (IS_INT(vm.stackTop[-1]) && IS_INT(vm.stackTop[-2])               \
+     && !builtin(valueToScaledInt(vm.stackTop[-2]), right(vm.stackTop[-1]), &(result)))
+#define COMPARE_OP(op)                                                \
+    do {                                                              \
+        Value const right = vm.stackTop[-1];                          \
+        Value const left = vm.stackTop[-2];                           \
+        if (IS_INT(left) && IS_INT(right)) {                          \
+            bool const result = valueToScaledInt(left) op valueToScaledInt(right); \
+            --vm.stackTop;                                            \
+            vm.stackTop[-1] = BOOL_VAL(result);                       \
+        } else {                                                      \
+            BINARY_OP(BOOL_VAL, op);                                  \
+        }                                                             \
+    } while (false)
 
     while (true) {
 #ifdef DEBUG_TRACE_EXECUTION
@@ -265,45 +604,34 @@ static InterpretResult run(void) {
             frame->slots[slot] = peek(0);
             break;
         }
-        case OP_GET_GLOBAL: {
-            ObjString *name = READ_STRING();
-            Value value;
-            if (!tableGet(&vm.globals, name, &value)) {
-                runtimeError("Undefined variable '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            push(value);
+        case OP_GET_GLOBAL:
+            if (!getGlobal(READ_STRING())) { return INTERPRET_RUNTIME_ERROR; }
             break;
-        }
-        case OP_DEFINE_GLOBAL: {
-            ObjString *name = READ_STRING();
-            tableSet(&vm.globals, name, peek(0));
-            pop();
+        case OP_DEFINE_GLOBAL:
+            defineGlobal(READ_STRING());
             break;
-        }
-        case OP_SET_GLOBAL: {
-            ObjString *name = READ_STRING();
-            if (tableSet(&vm.globals, name, peek(0))) {
-                tableDelete(&vm.globals, name);
-                runtimeError("Undefined variable '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
+        case OP_SET_GLOBAL:
+            if (!setGlobal(READ_STRING())) { return INTERPRET_RUNTIME_ERROR; }
             break;
-        }
         case OP_EQUAL: {
-            Value const b = pop();
-            Value const a = pop();
-            push(BOOL_VAL(valuesEqual(a, b)));
+            bool const equal = valuesEqual(peek(1), peek(0));
+            pop();
+            pop();
+            push(BOOL_VAL(equal));
             break;
         }
         case OP_GREATER:
-            BINARY_OP(BOOL_VAL, >);
+            COMPARE_OP(>);
             break;
         case OP_LESS:
-            BINARY_OP(BOOL_VAL, <);
-            break;
-        case OP_ADD:
-            if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+            COMPARE_OP(<);
+            break;
+        case OP_ADD: {
+            i64 result;  // NOLINT
+            if (INT_BINARY_OP(__builtin_add_overflow, valueToScaledInt, result)) {
+                --vm.stackTop;
+                vm.stackTop[-1] = scaledIntToValue(result);
+            } else if (IS_ANY_STRING(peek(0)) && IS_ANY_STRING(peek(1))) {
                 concatenate();
             } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
                 double const b = AS_NUMBER(pop());
@@ -314,14 +642,41 @@ static InterpretResult run(void) {
                 return INTERPRET_RUNTIME_ERROR;
             }
             break;
-        case OP_SUBTRACT:
-            BINARY_OP(NUMBER_VAL, -);
+        }
+        case OP_SUBTRACT: {
+            i64 result;  // NOLINT
+            if (INT_BINARY_OP(__builtin_sub_overflow, valueToScaledInt, result)) {
+                --vm.stackTop;
+                vm.stackTop[-1] = scaledIntToValue(result);
+            } else {
+                BINARY_OP(NUMBER_VAL, -);
+            }
             break;
-        case OP_MULTIPLY:
-            BINARY_OP(NUMBER_VAL, *);
+        }
+        case OP_MULTIPLY: {
+            i64 result;  // NOLINT
+            // A zero product with a negative operand is -0, which only doubles hold
+            if (INT_BINARY_OP(__builtin_mul_overflow, AS_INT, result)
+                && (result != 0 || (AS_INT(peek(0)) >= 0 && AS_INT(peek(1)) >= 0))) {
+                --vm.stackTop;
+                vm.stackTop[-1] = scaledIntToValue(result);
+            } else {
+                BINARY_OP(NUMBER_VAL, *);
+            }
             break;
+        }
         case OP_DIVIDE:
-            BINARY_OP(NUMBER_VAL, /);
+            // Only exact quotients stay integers, and 0 / -n is -0
+            if (IS_INT(peek(0)) && IS_INT(peek(1)) && AS_INT(peek(0)) != 0
+                && (AS_INT(peek(1)) != 0 || AS_INT(peek(0)) > 0)
+                && AS_INT(peek(1)) % AS_INT(peek(0)) == 0
+                && fitsSmallInt(AS_INT(peek(1)) / AS_INT(peek(0)))) {
+                i64 const b = AS_INT(pop());
+                i64 const a = AS_INT(pop());
+                push(INT_VAL(a / b));
+            } else {
+                BINARY_OP(NUMBER_VAL, /);
+            }
             break;
         case OP_NOT:
             push(BOOL_VAL(isFalsey(pop())));
@@ -331,11 +686,17 @@ static InterpretResult run(void) {
                 runtimeError("Operand must be a number.");
                 return INTERPRET_RUNTIME_ERROR;
             }
-            push(NUMBER_VAL(-AS_NUMBER(pop())));
+            // -0 is a double
+            if (IS_INT(peek(0)) && AS_INT(peek(0)) != 0 && fitsSmallInt(-AS_INT(peek(0)))) {
+                push(INT_VAL(-AS_INT(pop())));
+            } else {
+                push(NUMBER_VAL(-AS_NUMBER(pop())));
+            }
             break;
         case OP_PRINT: {
-            printValue(pop());
+            printValue(peek(0));
             printf("\n");
+            pop();
             break;
         }
         case OP_JUMP: {
@@ -348,6 +709,16 @@ static InterpretResult run(void) {
             if (isFalsey(peek(0))) { frame->ip += offset; }
             break;
         }
+        case OP_FOR_ITER: {
+            u8 *start = frame->ip - 1;
+            Value *iterator = &frame->slots[READ_BYTE()];
+            u16 const offset = READ_SHORT();
+            bool done;  // NOLINT
+            if (!iterate(frame, start, iterator, &done)) { return INTERPRET_RUNTIME_ERROR; }
+            if (done) { frame->ip += offset; }
+            frame = &vm.frames[vm.frameCount - 1];
+            break;
+        }
         case OP_LOOP: {
             u16 const offset = READ_SHORT();
             frame->ip -= offset;
@@ -375,76 +746,58 @@ static InterpretResult run(void) {
             frame = &vm.frames[vm.frameCount - 1];
             break;
         }
-        case OP_CLOSURE: {
-            ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-            ObjClosure *closure = newClosure(function);
-            push(OBJ_VAL(closure));
-            for (usize i = 0; i < closure->upvalueCount; ++i) {
-                u8 const isLocal = READ_BYTE();
-                u8 const index = READ_BYTE();
-                if (isLocal) {
-                    closure->upvalues[i] = captureUpvalue(frame->slots + index);
-                } else {
-                    closure->upvalues[i] = frame->closure->upvalues[index];
-                }
-            }
+        case OP_CLOSURE:
+            pushClosure(frame, AS_FUNCTION(READ_CONSTANT()), false);
             break;
-        }
         case OP_GET_UPVALUE: {
             u8 const slot = READ_BYTE();
-            push(*frame->closure->upvalues[slot]->location);
+            push(*AS_UPVALUE(frame->closure->upvalues[slot])->location);
             break;
         }
         case OP_SET_UPVALUE: {
             u8 const slot = READ_BYTE();
-            *frame->closure->upvalues[slot]->location = peek(0);
+            *AS_UPVALUE(frame->closure->upvalues[slot])->location = peek(0);
             break;
         }
-        case OP_CLOSE_UPVALUE:
-            closeUpvalues(vm.stackTop - 1U);
+        case OP_GET_FLAT_UPVALUE: {
+            u8 const slot = READ_BYTE();
+            push(frame->closure->upvalues[slot]);
+            break;
+        }
+        case OP_CLOSE_UPVALUE: {
+            ObjUpvalue *upvalue = vm.openUpvalueSlots[vm.stackTop - 1U - vm.stack];
+            if (upvalue != NULL) { closeUpvalue(upvalue); }
             pop();
             break;
+        }
         case OP_CLASS:
             push(OBJ_VAL(newClass(READ_STRING())));
             break;
-        case OP_GET_PROPERTY: {
-            if (!IS_INSTANCE(peek(0))) {
-                runtimeError("Only instances have properties.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            ObjInstance *instance = AS_INSTANCE(peek(0));
-            ObjString *name = READ_STRING();
-
-            Value value;
-            if (tableGet(&instance->fields, name, &value)) {
-                pop();  // instance
-                push(value);
-                break;
-            }
-            if (!bindMethod(instance->klass, name)) {
-                return INTERPRET_RUNTIME_ERROR;
-            }
+        case OP_GET_PROPERTY:
+            if (!getProperty(READ_STRING())) { return INTERPRET_RUNTIME_ERROR; }
             break;
-        }
-        case OP_SET_PROPERTY: {
-            if (!IS_INSTANCE(peek(1))) {
-                runtimeError("Only instances have fields.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            /* stack index 0->N from top to bottom
-             * <value to assign> -> index = 0
-             *  <instance field name> -> index = 1
-             * */
-            ObjInstance *instance = AS_INSTANCE(peek(1));
-            tableSet(&instance->fields, READ_STRING(), peek(0));
-            Value const value = pop();  // remove value from stack
-            pop();  // remove instance from stack
-            push(value);  // put value back into the stack (OP_SET_PROPERTY is an expression)
+        case OP_SET_PROPERTY:
+            if (!setProperty(READ_STRING())) { return INTERPRET_RUNTIME_ERROR; }
+            break;
+        case OP_LIST:
+            makeList(READ_BYTE());
+            break;
+        case OP_MAP:
+            if (!makeMap(READ_BYTE())) { return INTERPRET_RUNTIME_ERROR; }
+            break;
+        case OP_GET_INDEX:
+            if (!getIndex()) { return INTERPRET_RUNTIME_ERROR; }
+            break;
+        case OP_SET_INDEX:
+            if (!setIndex()) { return INTERPRET_RUNTIME_ERROR; }
             break;
-        }
         case OP_METHOD:
             defineMethod(READ_STRING());
             break;
+        case OP_END_CLASS:
+            sealClass(AS_CLASS(peek(0)));
+            pop();
+            break;
         case OP_INVOKE: {
             ObjString *method = READ_STRING();
             i32 const argCount = READ_BYTE();
@@ -464,32 +817,144 @@ static InterpretResult run(void) {
             // We still have to compile subclass methods. Any method of the subclass
             // with the same name as one from the superclass will in fact override
             // the supeclass method
-            tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+            ObjClass const *parent = AS_CLASS(superclass);
+            if (parent->isSealed) {
+                sealedTableAddAll(&parent->sealedMethods, &subclass->methods);
+            } else {
+                tableAddAll(&parent->methods, &subclass->methods);
+            }
             pop();  // subclass
             break;
         }
-        case OP_GET_SUPER: {
-            ObjString *name = READ_STRING();
-            ObjClass *superclass = AS_CLASS(pop());
-            if (!bindMethod(superclass, name)) {
-                return INTERPRET_RUNTIME_ERROR;
-            }
+        case OP_GET_SUPER:
+            if (!getSuper(READ_STRING())) { return INTERPRET_RUNTIME_ERROR; }
             break;
-        }
         case OP_SUPER_INVOKE: {
             ObjString *method = READ_STRING();
             i32 const argCount = READ_BYTE();
-            ObjClass *superclass = AS_CLASS(pop());
-            if (!invokeFromClass(superclass, method, argCount)) {
+            if (!superInvoke(method, argCount)) {
                 return INTERPRET_RUNTIME_ERROR;
             }
             frame = &vm.frames[vm.frameCount - 1];
             break;
         }
+        case OP_GUARD_CALLEE: {
+            // Runs the inlined body that follows only where OP_CALL would
+            // have called that function without error
+            ObjFunction const *function = AS_FUNCTION(READ_CONSTANT());
+            Value const callee = peek(READ_BYTE());
+            u16 const offset = READ_SHORT();
+            if (!IS_CLOSURE(callee) || AS_CLOSURE(callee)->function != function || !hasRoomFor(function)) {
+                frame->ip += offset;
+            }
+            break;
+        }
+        case OP_INLINE_RETURN: {
+            // The result replaces the callee and everything above it
+            u8 const count = READ_BYTE();
+            vm.stackTop[-1 - count] = vm.stackTop[-1];
+            vm.stackTop -= count;
+            break;
+        }
+        case OP_WIDE:
+            switch (READ_BYTE()) {
+            case OP_CONSTANT:
+                push(READ_WIDE_CONSTANT());
+                break;
+            case OP_GET_LOCAL:
+                push(frame->slots[READ_SHORT()]);
+                break;
+            case OP_SET_LOCAL:
+                frame->slots[READ_SHORT()] = peek(0);
+                break;
+            case OP_GET_GLOBAL:
+                if (!getGlobal(READ_WIDE_STRING())) { return INTERPRET_RUNTIME_ERROR; }
+                break;
+            case OP_DEFINE_GLOBAL:
+                defineGlobal(READ_WIDE_STRING());
+                break;
+            case OP_SET_GLOBAL:
+                if (!setGlobal(READ_WIDE_STRING())) { return INTERPRET_RUNTIME_ERROR; }
+                break;
+            case OP_GET_UPVALUE:
+                push(*AS_UPVALUE(frame->closure->upvalues[READ_SHORT()])->location);
+                break;
+            case OP_SET_UPVALUE:
+                *AS_UPVALUE(frame->closure->upvalues[READ_SHORT()])->location = peek(0);
+                break;
+            case OP_GET_FLAT_UPVALUE:
+                push(frame->closure->upvalues[READ_SHORT()]);
+                break;
+            case OP_JUMP: {
+                u32 const offset = READ_LONG();
+                frame->ip += offset;
+                break;
+            }
+            case OP_JUMP_IF_FALSE: {
+                u32 const offset = READ_LONG();
+                if (isFalsey(peek(0))) { frame->ip += offset; }
+                break;
+            }
+            case OP_LOOP: {
+                u32 const offset = READ_LONG();
+                frame->ip -= offset;
+                break;
+            }
+            case OP_FOR_ITER: {
+                u8 *start = frame->ip - 2;
+                Value *iterator = &frame->slots[READ_SHORT()];
+                u32 const offset = READ_LONG();
+                bool done;  // NOLINT
+                if (!iterate(frame, start, iterator, &done)) { return INTERPRET_RUNTIME_ERROR; }
+                if (done) { frame->ip += offset; }
+                frame = &vm.frames[vm.frameCount - 1];
+                break;
+            }
+            case OP_CLOSURE:
+                pushClosure(frame, AS_FUNCTION(READ_WIDE_CONSTANT()), true);
+                break;
+            case OP_CLASS:
+                push(OBJ_VAL(newClass(READ_WIDE_STRING())));
+                break;
+            case OP_GET_PROPERTY:
+                if (!getProperty(READ_WIDE_STRING())) { return INTERPRET_RUNTIME_ERROR; }
+                break;
+            case OP_SET_PROPERTY:
+                if (!setProperty(READ_WIDE_STRING())) { return INTERPRET_RUNTIME_ERROR; }
+                break;
+            case OP_METHOD:
+                defineMethod(READ_WIDE_STRING());
+                break;
+            case OP_INVOKE: {
+                ObjString *method = READ_WIDE_STRING();
+                i32 const argCount = READ_BYTE();
+                if (!invoke(method, argCount)) { return INTERPRET_RUNTIME_ERROR; }
+                frame = &vm.frames[vm.frameCount - 1];
+                break;
+            }
+            case OP_GET_SUPER:
+                if (!getSuper(READ_WIDE_STRING())) { return INTERPRET_RUNTIME_ERROR; }
+                break;
+            case OP_SUPER_INVOKE: {
+                ObjString *method = READ_WIDE_STRING();
+                i32 const argCount = READ_BYTE();
+                if (!superInvoke(method, argCount)) { return INTERPRET_RUNTIME_ERROR; }
+                frame = &vm.frames[vm.frameCount - 1];
+                break;
+            }
+            default:
+                __builtin_unreachable();
+            }
+            break;
         }
     }
 
 #undef BINARY_OP
+#undef INT_BINARY_OP
+#undef COMPARE_OP
+#undef READ_WIDE_STRING
+#undef READ_WIDE_CONSTANT
+#undef READ_LONG
 #undef READ_STRING
 #undef READ_CONSTANT
 #undef READ_BYTE
@@ -506,16 +971,22 @@ void initVM(void) {
     vm.grayStack = NULL;
     initTable(&vm.globals);
     initTable(&vm.strings);
+    initTable(&vm.assignedGlobals);
 
+    vm.initString = NULL;  // Prevent GC to read garbage from initString if triggered from copyString
+    vm.nextString = NULL;
     vm.initString = copyString("init", 4);
+    vm.nextString = copyString("next", 4);
 
-    defineNative("clock", clockNative);
+    defineNatives();
 }
 
 void freeVM(void) {
     freeTable(&vm.globals);
     freeTable(&vm.strings);
+    freeTable(&vm.assignedGlobals);
     vm.initString = NULL;
+    vm.nextString = NULL;
     freeObjects();
 }
 
@@ -8,7 +8,9 @@
 #include "value.h"
 
 #define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Frames of up to 256 slots fit in half the stack. Bigger ones are checked
+// for room when called.
+#define STACK_MAX (FRAMES_MAX * UINT8_COUNT * 2U)
 
 // Represents a single ongoing function call
 typedef struct {
@@ -24,8 +26,11 @@ typedef struct {
     Value *stackTop;
     Table globals;
     Table strings;
+    Table assignedGlobals;  // Globals that optimized code assigns to anywhere
     ObjString *initString;
+    ObjString *nextString;
     ObjUpvalue *openUpvalues;
+    ObjUpvalue *openUpvalueSlots[STACK_MAX];  // Open upvalue of each stack slot, if any
     usize bytesAllocated;
     usize nextGC;
     Obj *objects;
@@ -46,6 +51,8 @@ void initVM(void);
 void freeVM(void);
 
 InterpretResult interpret(const char *source);
+void runtimeError(const char *format, ...);
+void defineNative(const char *name, i32 arity, NativeFn function);
 void push(Value value);
 Value pop(void);
 